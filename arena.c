@@ -0,0 +1,167 @@
+/*
+ * Arenas for plugins' short-lived strings
+ * Separate module so every plugin shares one copy per process
+ *
+ * Strings a hook builds and drops, or that only have to last until
+ * the next message, are carved out of a big block here rather than
+ * each being malloc'd (and, too often, never freed).  AR_MSG is
+ * emptied in one go at RSET and between messages; AR_SESSION lasts as
+ * long as the connection.  The blocks are kept and reused, so a long
+ * session stays the size of its biggest message.
+ *
+ * Nothing else empties AR_MSG: every plugin that allocates from it
+ * must call ar_reset(AR_MSG) from its own reset hook.  Only the first
+ * call of a round does anything, the rest find it empty.
+ *
+ * void* ar_alloc(int a, unsigned long n) -> n bytes in arena a, 0 if no memory
+ * char* ar_strb(int a, const char *s, unsigned long len) -> a copy with a NUL
+ * char* ar_cat(int a, const char *s, ...) -> the strings up to a null
+ *   pointer, joined
+ * int ar_str(int a, str *out, const char *s, unsigned long len)
+ *  -> 1 with out pointing at a copy of s, 0 if no memory; out can be
+ *  read, truncated, and passed to things that only read it, like
+ *  ctl_lookup, but must not be grown with str_ functions, nor str_free'd
+ * void ar_reset(int a) empty it, if it isn't already
+ *
+ * ARENASTATS: at each reset of AR_MSG, log how much each arena has
+ * used and the most either has ever used
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include "mailfront.h"
+#include <msg/msg.h>
+#include <str/str.h>
+
+#define AR_MSG 0
+#define AR_SESSION 1
+
+#define ARBLOCK 16384
+#define ARALIGN 16
+
+struct arblock {
+  struct arblock *next;
+  unsigned long size;
+  unsigned long used;
+  /* then the space */
+};
+
+static struct arena {
+  struct arblock *first;
+  struct arblock *cur;
+  unsigned long inuse;		/* since the last reset */
+  unsigned long high;		/* most ever */
+  unsigned long blocks;
+} arenas[2];
+
+static void *ar_new_block(struct arena *ar, unsigned long n)
+{
+  unsigned long size = n > ARBLOCK ? n : ARBLOCK;
+  struct arblock *b = malloc(sizeof *b + ARALIGN + size);
+
+  if(!b) return 0;
+  b->next = 0;
+  b->size = size;
+  b->used = 0;
+  if(ar->cur) ar->cur->next = b;
+  else ar->first = b;
+  ar->cur = b;
+  ar->blocks++;
+  return b;
+}
+
+static char *ar_space(struct arblock *b)
+{
+  char *p = (char *)(b + 1);
+
+  return p + ((ARALIGN - (unsigned long)p % ARALIGN) % ARALIGN);
+}
+
+void *ar_alloc(int a, unsigned long n)
+{
+  struct arena *ar = &arenas[a != AR_MSG];
+  struct arblock *b;
+  char *p;
+
+  n = (n + ARALIGN - 1) & ~(unsigned long)(ARALIGN - 1);
+  if(!ar->cur && (ar->cur = ar->first) == 0 && !ar_new_block(ar, n)) return 0;
+  /* a used-up block may be followed by ones kept from before the reset */
+  for(b = ar->cur; b->size - b->used < n; b = b->next) {
+    if(!b->next && !ar_new_block(ar, n)) return 0;
+    b->next->used = 0;
+    ar->cur = b->next;
+  }
+  p = ar_space(b) + b->used;
+  b->used += n;
+  ar->inuse += n;
+  if(ar->inuse > ar->high) ar->high = ar->inuse;
+  return p;
+}
+
+char *ar_strb(int a, const char *s, unsigned long len)
+{
+  char *p = ar_alloc(a, len + 1);
+
+  if(!p) return 0;
+  memcpy(p, s, len);
+  p[len] = 0;
+  return p;
+}
+
+char *ar_cat(int a, const char *s, ...)
+{
+  va_list ap;
+  const char *t;
+  unsigned long len = 0;
+  char *p, *q;
+
+  va_start(ap, s);
+  for(t = s; t; t = va_arg(ap, const char *)) len += strlen(t);
+  va_end(ap);
+  if((p = q = ar_alloc(a, len + 1)) == 0) return 0;
+  va_start(ap, s);
+  for(t = s; t; t = va_arg(ap, const char *)) {
+    len = strlen(t);
+    memcpy(q, t, len);
+    q += len;
+  }
+  va_end(ap);
+  *q = 0;
+  return p;
+}
+
+int ar_str(int a, str *out, const char *s, unsigned long len)
+{
+  char *p = ar_strb(a, s, len);
+
+  if(!p) return 0;
+  out->s = p;
+  out->len = len;
+  out->size = len + 1;
+  return 1;
+}
+
+void ar_reset(int a)
+{
+  struct arena *ar = &arenas[a != AR_MSG];
+  static str stats;
+
+  if(!ar->inuse) return;
+  if(a == AR_MSG && session_getenv("ARENASTATS")) {
+    str_copys(&stats, "arena msg ");
+    str_catu(&stats, ar->inuse);
+    str_cats(&stats, " high ");
+    str_catu(&stats, ar->high);
+    str_cats(&stats, " session ");
+    str_catu(&stats, arenas[AR_SESSION].inuse);
+    str_cats(&stats, " high ");
+    str_catu(&stats, arenas[AR_SESSION].high);
+    str_cats(&stats, " blocks ");
+    str_catu(&stats, ar->blocks + arenas[AR_SESSION].blocks);
+    msg1(stats.s);
+  }
+  ar->cur = ar->first;
+  if(ar->cur) ar->cur->used = 0;
+  ar->inuse = 0;
+}
@@ -4,15 +4,62 @@
  * SUMPDOMAIN: RELAYCLIENT value to say sump, usually @sump
  * SUMPADDR: address of the sump
  * RBLSMTPD: failure message for sump faux failure
+ * QQHELPER: socket of a qqhelper to start qmail-queue for us,
+ *   otherwise it's started with posix_spawn
+ * QQTIMING: log how long each message_end took, in microseconds
+ * QQPIPESIZE: size to make the pipes to qmail-queue, default 128k,
+ *   0 to leave the kernel's 64k.  Capped by the kernel at
+ *   /proc/sys/fs/pipe-max-size, and once a user's pipes add up past
+ *   /proc/sys/fs/pipe-user-pages-soft (64M) new ones get one page, so
+ *   keep it times the number of concurrent sessions under that
+ * QQBATCH: collect message data blocks up to this size before
+ *   writing them to qmail-queue, default 64k
+ * QQSTATS: log bytes, writes, and throughput for each message; writes
+ *   are the write and sendfile calls feeding qmail-queue, none when it
+ *   reads an unedited spool file itself
+ *
+ * Header edits plugins noted in the msgedit journal are made as the
+ * file is fed to qmail-queue through a pipe, rather than the file being
+ * rewritten.
+ *
+ * SUMPSTORE: directory to keep sump mail in, instead of queueing it
+ *   to SUMPADDR.  Messages are appended to compressed segment files
+ *   seg.N, each record being a line
+ *     "S hdrlen bodylen bodyref sha256-of-body\n"
+ *   then hdrlen bytes of deflated header and bodylen bytes of deflated
+ *   body.  A body seen in the last SUMPDEDUPTTL seconds (default a day)
+ *   is not stored again, bodylen is 0 and bodyref is the seg.offset of
+ *   the record that has it, otherwise bodyref is "-".
+ *   The file "index" gets a line for each recipient,
+ *     "time ip recipient seg offset"
+ *   with "- -" for messages that weren't stored.
+ * SUMPSAMPLE: store one in this many sump messages, default 1 (all)
+ * SUMPSEGSIZE: start a new segment past this size, default 64M
+ *
+ * With plugin-dedup, final responses are kept under the session's
+ * msghash for DEDUPTTL seconds (default 600), and a message it marks
+ * dupmsg gets the stored response without being queued, or a 451 if
+ * it has expired since, as the scanners skipped the message.
  */
 #include <sysdeps.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <time.h>
+#include <sys/file.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include <sys/wait.h>
 #include <unistd.h>
+#include <zlib.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 #include <misc/misc.h>
 #include <msg/msg.h>
+#include <net/socket.h>
 #include <unix/sig.h>
 #include "mailfront.h"
 #include "conf_qmail.c"
@@ -22,15 +69,44 @@ static RESPONSE(no_pipe,451,"4.3.0 Could not open pipe to qmail-queue.");
 static RESPONSE(no_fork,451,"4.3.0 Could not start qmail-queue.");
 static RESPONSE(no_chdir,451,"4.3.0 Could not change to the qmail directory.");
 static RESPONSE(qq_crashed,451,"4.3.0 qmail-queue crashed.");
+static RESPONSE(dup_lost,451,"4.3.0 Lost the answer to the first copy, try again.");
 
 static str buffer;
 static str sumpbuffer;
+static str qqbuf;		/* data blocks not yet written */
+static unsigned long qqbatch;
 static unsigned long databytes;
+static unsigned long qqwrites;
+static struct timeval datastart;
+static int sumpstore;		/* this message goes to SUMPSTORE */
+static int sumpblocks;		/* fed from data_block, there's no file */
+static str sumprcpts;		/* LF terminated, for the index */
+
+extern int shm_open_table(const char *name, unsigned nslots, unsigned vsize);
+extern int shm_fetch(int t, const char *key, unsigned klen, void *val);
+extern int shm_store(int t, const char *key, unsigned klen, const void *val, unsigned ttl);
+extern int med_count(void);
+extern off_t med_size(off_t size);
+extern int med_write(int out, int fd, off_t size);
+extern unsigned long med_calls(void);
+extern void med_reset(void);
+extern void mh_reset(void);
+
+/* same as plugin-dedup */
+struct dedupresp {
+  unsigned number;
+  char message[256];
+};
+
+static int deduptab = -2;
 
 static const char* qqargs[2] = { 0, 0 };
-static int qqpid = -1;
+static pid_t qqpid = -1;
 static int qqepipe[2] = { -1, -1 };
 static int qqmpipe[2] = { -1, -1 };
+static int qqsock = -1;		/* to qqhelper, instead of qqepipe */
+
+extern char **environ;
 
 static void close_qqpipe(void)
 {
@@ -49,14 +125,27 @@ static const response* init(void)
   if(sump && rc && !strcmp(sump, rc)) {
     session_setnum("sump", 1);
   }
+  session_setnum("msgedit", 1);	/* we apply the msgedit journal */
   return 0;
 }
 
+static void close_qqsock(void)
+{
+  if (qqsock != -1) close(qqsock);
+  qqsock = -1;
+}
+
 static const response* reset(void)
 {
   close_qqpipe();
+  close_qqsock();
   str_truncate(&buffer, 0);
   str_truncate(&sumpbuffer, 0);
+  str_truncate(&sumprcpts, 0);
+  sumpstore = 0;
+  sumpblocks = 0;
+  med_reset();
+  mh_reset();
   return 0;
 }
 
@@ -77,6 +166,8 @@ static const response* do_recipient(str* recipient, str* params)
     if(!str_cats(&sumpbuffer, "Spam-To: ") ||
       !str_catb(&sumpbuffer, recipient->s, p) ||
       !str_catc(&sumpbuffer, LF)) return &resp_oom;
+    if(!str_catb(&sumprcpts, recipient->s, p) ||
+      !str_catc(&sumprcpts, LF)) return &resp_oom;
     return 0;
   } 
 
@@ -87,28 +178,367 @@ static const response* do_recipient(str* recipient, str* params)
   (void)params;
 }
 
+/* sump store, see SUMPSTORE above */
+
+struct sumpref {
+  uint32_t seg;
+  uint32_t pad;
+  uint64_t off;
+};
+
+static z_stream sumphz, sumpbz;	/* header and body */
+static int sumpzinit;
+static str sumphdr, sumpbody;	/* deflated */
+static EVP_MD_CTX *sumpsha;
+static int sumpinbody;
+static int sumpbol;		/* at beginning of a header line */
+static int sumpsampled;
+
+static int sump_deflate(z_stream *z, str *out, const char *bytes,
+			unsigned long len, int flush)
+{
+  int r;
+
+  z->next_in = (Bytef*)bytes;
+  z->avail_in = len;
+  do {
+    if (!str_ready(out, out->len + 16384)) return 0;
+    z->next_out = (Bytef*)out->s + out->len;
+    z->avail_out = out->size - out->len;
+    r = deflate(z, flush);
+    if (r == Z_STREAM_ERROR) return 0;
+    out->len = out->size - z->avail_out;
+  } while (z->avail_in > 0 || (flush == Z_FINISH && r != Z_STREAM_END));
+  return 1;
+}
+
+static int sump_start(void)
+{
+  const char *s;
+  unsigned long sample = 1;
+
+  if (!sumpzinit) {
+    if (deflateInit(&sumphz, Z_DEFAULT_COMPRESSION) != Z_OK
+	|| deflateInit(&sumpbz, Z_DEFAULT_COMPRESSION) != Z_OK
+	|| (sumpsha = EVP_MD_CTX_new()) == 0)
+      return 0;
+    srandom(getpid() ^ time(0));
+    sumpzinit = 1;
+  }
+  deflateReset(&sumphz);
+  deflateReset(&sumpbz);
+  if (!EVP_DigestInit_ex(sumpsha, EVP_sha256(), 0)) return 0;
+  str_truncate(&sumphdr, 0);
+  str_truncate(&sumpbody, 0);
+  sumpinbody = 0;
+  sumpbol = 1;
+
+  if ((s = session_getenv("SUMPSAMPLE")) != 0) sample = strtoul(s, 0, 10);
+  sumpsampled = sample > 0 && random() % sample == 0;
+  return 1;
+}
+
+/* split at the blank line, hash the body, compress both */
+static int sump_feed(const char *bytes, unsigned long len)
+{
+  unsigned long i;
+
+  if (!sumpsampled) return 1;
+  if (!sumpinbody) {
+    for (i = 0; i < len && !sumpinbody; i++) {
+      if (bytes[i] == LF) {
+	if (sumpbol) sumpinbody = 1;
+	sumpbol = 1;
+      }
+      else if (bytes[i] != '\r')
+	sumpbol = 0;
+    }
+    if (!sump_deflate(&sumphz, &sumphdr, bytes, i, Z_NO_FLUSH)) return 0;
+    bytes += i;
+    len -= i;
+  }
+  if (len == 0) return 1;
+  if (!EVP_DigestUpdate(sumpsha, bytes, len)) return 0;
+  return sump_deflate(&sumpbz, &sumpbody, bytes, len, Z_NO_FLUSH);
+}
+
+static int sump_feedfd(int fd)
+{
+  char buf[65536];
+  long rd;
+
+  if (lseek(fd, 0, SEEK_SET) != 0) return 0;
+  while ((rd = read(fd, buf, sizeof buf)) > 0)
+    if (!sump_feed(buf, rd)) return 0;
+  return rd == 0;
+}
+
+/* append the record and index lines, 0 for failure */
+static int sump_write(void)
+{
+  static int sumpdeduptab = -2;
+  static str line;
+  const char *dir;
+  const char *ip;
+  const char *s;
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  struct sumpref ref;
+  struct stat st;
+  struct iovec iov[3];
+  uint32_t seg = 0;
+  unsigned long segsize = 64UL*1024*1024;
+  unsigned long ttl = 86400;
+  int dup = 0;
+  int lockfd, segfd = -1, idxfd = -1;
+  int ok = 0;
+  unsigned i;
+
+  if ((dir = session_getenv("SUMPSTORE")) == 0) return 0;
+  if ((s = session_getenv("SUMPSEGSIZE")) != 0) segsize = strtoul(s, 0, 10);
+  if ((s = session_getenv("SUMPDEDUPTTL")) != 0) ttl = strtoul(s, 0, 10);
+  if ((ip = getprotoenv("REMOTEIP")) == 0) ip = UNKNOWN;
+
+  if (sumpsampled) {
+    if (!sump_deflate(&sumphz, &sumphdr, 0, 0, Z_FINISH)
+	|| !sump_deflate(&sumpbz, &sumpbody, 0, 0, Z_FINISH))
+      return 0;
+    if (!EVP_DigestFinal_ex(sumpsha, hash, 0)) return 0;
+    if (sumpdeduptab == -2)
+      sumpdeduptab = shm_open_table("sumpdedup", 65536, sizeof ref);
+    dup = shm_fetch(sumpdeduptab, (char*)hash, sizeof hash, &ref);
+  }
+
+  /* the lock file holds the current segment number */
+  if (!str_copy2s(&line, dir, "/lock")) return 0;
+  if ((lockfd = open(line.s, O_RDWR|O_CREAT, 0600)) == -1) return 0;
+  if (flock(lockfd, LOCK_EX) != 0) goto done;
+
+  if (sumpsampled) {
+    if (pread(lockfd, &seg, sizeof seg, 0) != sizeof seg) seg = 0;
+    for (;;) {
+      if (!str_copy2s(&line, dir, "/seg.") || !str_catu(&line, seg)) goto done;
+      if ((segfd = open(line.s, O_WRONLY|O_APPEND|O_CREAT, 0600)) == -1
+	  || fstat(segfd, &st) != 0)
+	goto done;
+      if ((unsigned long)st.st_size < segsize) break;
+      close(segfd);
+      seg++;
+      if (pwrite(lockfd, &seg, sizeof seg, 0) != sizeof seg) goto done;
+    }
+
+    if (!str_copys(&line, "S ") || !str_catu(&line, sumphdr.len)) goto done;
+    if (dup) {
+      if (!str_cats(&line, " 0 ") || !str_catu(&line, ref.seg)
+	  || !str_catc(&line, '.') || !str_catu(&line, ref.off))
+	goto done;
+    }
+    else if (!str_catc(&line, ' ') || !str_catu(&line, sumpbody.len)
+	     || !str_cats(&line, " -"))
+      goto done;
+    if (!str_catc(&line, ' ')) goto done;
+    for (i = 0; i < sizeof hash; i++)
+      if (!str_catc(&line, "0123456789abcdef"[hash[i] >> 4])
+	  || !str_catc(&line, "0123456789abcdef"[hash[i] & 15]))
+	goto done;
+    if (!str_catc(&line, LF)) goto done;
+
+    iov[0].iov_base = line.s;
+    iov[0].iov_len = line.len;
+    iov[1].iov_base = sumphdr.s;
+    iov[1].iov_len = sumphdr.len;
+    iov[2].iov_base = sumpbody.s;
+    iov[2].iov_len = dup ? 0 : sumpbody.len;
+    if (writev(segfd, iov, 3)
+	!= (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len)) {
+      /* don't leave half a record for the next one to follow */
+      if (ftruncate(segfd, st.st_size) != 0) {}
+      goto done;
+    }
+    if (!dup) {
+      ref.seg = seg;
+      ref.pad = 0;
+      ref.off = st.st_size;
+      shm_store(sumpdeduptab, (char*)hash, sizeof hash, &ref, ttl);
+    }
+  }
+
+  /* one index line per recipient, written in one go */
+  if (!str_copy2s(&line, dir, "/index")) goto done;
+  if ((idxfd = open(line.s, O_WRONLY|O_APPEND|O_CREAT, 0600)) == -1) goto done;
+  str_truncate(&line, 0);
+  for (i = 0; i < sumprcpts.len; ) {
+    unsigned e = str_findnext(&sumprcpts, LF, i);
+
+    if (!str_catu(&line, time(0)) || !str_catc(&line, ' ')
+	|| !str_cats(&line, ip) || !str_catc(&line, ' ')
+	|| !str_catb(&line, sumprcpts.s + i, e - i))
+      goto done;
+    if (sumpsampled) {
+      if (!str_catc(&line, ' ') || !str_catu(&line, seg) || !str_catc(&line, ' ')
+	  || !str_catu(&line, st.st_size))
+	goto done;
+    }
+    else if (!str_cats(&line, " - -"))
+      goto done;
+    if (!str_catc(&line, LF)) goto done;
+    i = e + 1;
+  }
+  ok = write(idxfd, line.s, line.len) == (ssize_t)line.len;
+
+ done:
+  if (idxfd != -1) close(idxfd);
+  if (segfd != -1) close(segfd);
+  close(lockfd);		/* drops the lock */
+  return ok;
+}
+
+/* hand the message fd to qqhelper, envelope goes to qqsock */
+static int start_helper(const char* path, int msgfd)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cmh;
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cm;
+
+  if ((qqsock = socket_unixstr()) == -1) return -1;
+  if (!socket_connectu(qqsock, path)) {
+    close_qqsock();
+    return -1;
+  }
+
+  memset(&mh, 0, sizeof mh);
+  iov.iov_base = "Q";
+  iov.iov_len = 1;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cm.buf;
+  mh.msg_controllen = sizeof cm.buf;
+  cmh = CMSG_FIRSTHDR(&mh);
+  cmh->cmsg_level = SOL_SOCKET;
+  cmh->cmsg_type = SCM_RIGHTS;
+  cmh->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmh), &msgfd, sizeof msgfd);
+  if (sendmsg(qqsock, &mh, 0) != 1) {
+    close_qqsock();
+    return -1;
+  }
+  return 0;
+}
+
+/* grow a pointer array to hold n */
+static int ready_env(char*** env, unsigned long* size, unsigned long n)
+{
+  char** e;
+
+  if (n <= *size) return 1;
+  if ((e = realloc(*env, n * sizeof *e)) == 0) return 0;
+  *env = e;
+  *size = n;
+  return 1;
+}
+
+/* posix_spawn's environment, ours with the session's on top;
+ * session_exportenv() sets it in our own environ, so copy that and
+ * then put back what was there, so getenv() in plugins doesn't see
+ * this message's session environment from then on */
+static char** spawn_env(void)
+{
+  static char** before;
+  static char** envp;
+  static unsigned long beforesize, envpsize;
+  static str name;
+  unsigned long n, i, j, len;
+  int ok;
+
+  for (n = 0; environ[n]; n++) ;
+  if (!ready_env(&before, &beforesize, n + 1)) return 0;
+  memcpy(before, environ, (n + 1) * sizeof *before);
+
+  ok = session_exportenv();
+  for (i = 0; environ[i]; i++) ;
+  if (!ready_env(&envp, &envpsize, i + 1)) return 0;
+  memcpy(envp, environ, (i + 1) * sizeof *envp);
+
+  /* undo each entry that wasn't there before */
+  for (i = 0; envp[i]; i++) {
+    for (j = 0; j < n && before[j] != envp[i]; j++) ;
+    if (j < n) continue;
+    len = strcspn(envp[i], "=");
+    for (j = 0; j < n; j++)
+      if (!strncmp(before[j], envp[i], len) && before[j][len] == '=') break;
+    if (j < n) putenv(before[j]);
+    else if (!str_copyb(&name, envp[i], len) || unsetenv(name.s) != 0) ok = 0;
+  }
+  return ok ? envp : 0;
+}
+
 static int start_qq(int msgfd, int envfd)
 {
-  if ((qqpid = fork()) == -1) {
+  char** envp;
+  posix_spawn_file_actions_t fa;
+  const char* helper;
+  int i;
+
+  if ((helper = session_getenv("QQHELPER")) != 0) {
+    if (start_helper(helper, msgfd) == 0) return 0;
+    msg2("can't use qqhelper at ", helper);
+  }
+
+  /* no fork, so the environment has to be set up here */
+  if ((envp = spawn_env()) == 0) {
     close_qqpipe();
     return -1;
   }
-
-  if (qqpid == 0) {
-    if (!session_exportenv()) exit(51);
-    if (dup2(msgfd, 0) == -1) exit(120);
-    if (dup2(envfd, 1) == -1) exit(120);
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, msgfd, 0);
+  posix_spawn_file_actions_adddup2(&fa, envfd, 1);
+  for (i = 0; i < 2; i++) {
+    if (qqepipe[i] > 1) posix_spawn_file_actions_addclose(&fa, qqepipe[i]);
+    if (qqmpipe[i] > 1) posix_spawn_file_actions_addclose(&fa, qqmpipe[i]);
+  }
+  i = posix_spawnp(&qqpid, qqargs[0], &fa, 0, (char**)qqargs, envp);
+  posix_spawn_file_actions_destroy(&fa);
+  if (i != 0) {
     close_qqpipe();
-    execvp(qqargs[0], (char**)qqargs);
-    exit(120);
+    return -1;
   }
   return 0;
 }
 
+/* exit status of qmail-queue, -1 if it crashed */
+static int wait_qq(void)
+{
+  int status;
+
+  if (qqsock != -1) {		/* qqhelper tells us */
+    int reply[2];
+    unsigned long got = 0;
+    long r;
+
+    while (got < sizeof reply) {
+      r = read(qqsock, (char*)reply + got, sizeof reply - got);
+      if (r <= 0) break;
+      got += r;
+    }
+    close_qqsock();
+    if (got != sizeof reply) return -1;
+    qqpid = reply[1];
+    return reply[0];
+  }
+
+  if (waitpid(qqpid, &status, WUNTRACED) == -1) return -1;
+  if (!WIFEXITED(status)) return -1;
+  return WEXITSTATUS(status);
+}
+
 static int retry_write(int fd, const char* bytes, unsigned long len)
 {
   while (len) {
     unsigned long written = write(fd, bytes, len);
+    qqwrites++;
     if (written == (unsigned long)-1) return 0;
     len -= written;
     bytes += written;
@@ -116,9 +546,41 @@ static int retry_write(int fd, const char* bytes, unsigned long len)
   return 1;
 }
 
+/* bigger pipes mean fewer context switches per message */
+static void size_pipe(int fd)
+{
+#ifdef F_SETPIPE_SZ
+  const char* s;
+  long size = 128*1024;
+
+  if ((s = session_getenv("QQPIPESIZE")) != 0) size = strtol(s, 0, 10);
+  if (size > 0) fcntl(fd, F_SETPIPE_SZ, size);
+#else
+  (void)fd;
+#endif
+}
+
+static int flush_qqbuf(void)
+{
+  if (qqbuf.len == 0) return 1;
+  if (!retry_write(qqmpipe[1], qqbuf.s, qqbuf.len)) return 0;
+  qqbuf.len = 0;
+  return 1;
+}
+
+static unsigned long usec_since(const struct timeval* start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1000000
+    + now.tv_usec - start->tv_usec;
+}
+
 static const response* data_start(int fd)
 {
   const char* qh;
+  const char* s;
 
   qqargs[0] = session_getenv("QMAILQUEUE");
   if (qqargs[0] == 0) qqargs[0] = "bin/qmail-queue";
@@ -129,20 +591,41 @@ static const response* data_start(int fd)
 
   sig_pipe_block();
 
+  if (session_getnum("sump",0) && session_getenv("SUMPSTORE")) {
+    sumpstore = 1;
+    /* with a file it's all read at message_end, just once */
+    if (fd < 0) {
+      sumpblocks = 1;
+      if (!sump_start()) return &resp_oom;
+    }
+    return 0;
+  }
+
   if (pipe(qqepipe) == -1) return &resp_no_pipe;
 
+  gettimeofday(&datastart, NULL);
+  databytes = 0;
+  qqwrites = 0;
+  qqbuf.len = 0;
+
   if (fd < 0) {
     if (pipe(qqmpipe) == -1) {
       close_qqpipe();
       return &resp_no_pipe;
     }
+    size_pipe(qqmpipe[1]);
+
+    qqbatch = 65536;
+    if ((s = session_getenv("QQBATCH")) != 0) qqbatch = strtoul(s, 0, 10);
+    if (!str_ready(&qqbuf, qqbatch)) {
+      close_qqpipe();
+      return &resp_oom;
+    }
 
     if (start_qq(qqmpipe[0], qqepipe[0]) == -1)
       return &resp_no_fork;
   }
 
-  databytes = 0;
-
   if(session_getnum("sump",0)) {
     const char *sumpaddr = session_getenv("SUMPADDR");
 
@@ -156,8 +639,7 @@ static const response* data_start(int fd)
       if (write(fd, sumpbuffer.s, sumpbuffer.len) != (ssize_t)sumpbuffer.len)
 	return &resp_no_write;
     } else {
-      if (!retry_write(qqmpipe[1], sumpbuffer.s, sumpbuffer.len))
-	return &resp_no_write;
+      if (!str_cat(&qqbuf, &sumpbuffer)) return &resp_oom;
     }
   }
 
@@ -166,10 +648,20 @@ static const response* data_start(int fd)
 
 static const response* data_block(const char* bytes, unsigned long len)
 {
+  if (sumpblocks && !sump_feed(bytes, len)) return &resp_oom;
   if (qqmpipe[1] >= 0) {
-    if (!retry_write(qqmpipe[1], bytes, len))
-      return &resp_no_write;
     databytes += len;
+    /* SMTP hands us small blocks, write them out in big ones */
+    if (qqbuf.len + len <= qqbatch) {
+      if (!str_catb(&qqbuf, bytes, len)) return &resp_oom;
+      return 0;
+    }
+    if (!flush_qqbuf()) return &resp_no_write;
+    if (len >= qqbatch) {
+      if (!retry_write(qqmpipe[1], bytes, len))
+	return &resp_no_write;
+    }
+    else if (!str_catb(&qqbuf, bytes, len)) return &resp_oom;
   }
   return 0;
 }
@@ -212,14 +704,88 @@ static void parse_status(int status, response* resp)
   resp->message = message;
 }
 
+static void sump_reject(response* resp)
+{
+  char *sumpmsg = (char *)session_getenv("RBLSMTPD");
+
+  if(!sumpmsg) sumpmsg = "5.3.0 Message refused.";
+  if(*sumpmsg == '-') sumpmsg++; /* always reject */
+  msg2("sump reject: ", sumpmsg);
+  resp->number = 553;
+  resp->message = sumpmsg;
+}
+
+/* answer a client retry the same as the first copy; if that answer
+   has gone since plugin-dedup saw it, the scanners have still skipped
+   this copy, so it's not queued either, the client retries */
+static const response* dedup_fetch(void)
+{
+  static struct dedupresp dr;
+  static response resp;
+  const char *key = session_getstr("msghash");
+  int found;
+  int status;
+
+  if (deduptab == -2) deduptab = shm_open_table("dedup", 4096, sizeof dr);
+  found = key && *key && shm_fetch(deduptab, key, strlen(key), &dr);
+
+  /* qmail-queue without an envelope queues nothing */
+  close_qqpipe();
+  if (qqsock != -1) close_qqsock();
+  else if (qqpid > 0) waitpid(qqpid, &status, 0);
+  qqpid = -1;
+
+  if (!found) {
+    msg1("duplicate, but the first copy's answer is gone, not queued");
+    return &resp_dup_lost;
+  }
+  msg2("duplicate, not queued: ", dr.message);
+  resp.number = dr.number;
+  resp.message = dr.message;
+  return &resp;
+}
+
+static void dedup_store(const response* resp)
+{
+  struct dedupresp dr;
+  const char *key = session_getstr("msghash");
+  const char *s;
+  unsigned long ttl = 600;
+
+  if (!key || !*key) return;
+  if ((s = session_getenv("DEDUPTTL")) != 0) ttl = strtoul(s, 0, 10);
+  memset(&dr, 0, sizeof dr);
+  dr.number = resp->number;
+  strncpy(dr.message, resp->message, sizeof dr.message - 1);
+  if (deduptab == -2) deduptab = shm_open_table("dedup", 4096, sizeof dr);
+  shm_store(deduptab, key, strlen(key), &dr, ttl);
+}
+
 static const response* message_end(int fd)
 {
   static response resp;
 
   int status;
   struct stat st;
+  struct timeval start;
+
+  gettimeofday(&start, NULL);
+
+  if (session_getnum("dupmsg", 0)) return dedup_fetch();
+
+  if (sumpstore) {
+    /* the file as received, plugins note no edits for sump mail */
+    if (fd >= 0 && (!sump_start() || !sump_feedfd(fd)))
+      return &resp_internal;
+    if (!sump_write())
+      msg2("sump store failed in ", session_getenv("SUMPSTORE"));
+    sump_reject(&resp);
+    dedup_store(&resp);
+    return &resp;
+  }
 
   if (fd < 0) {
+    if (!flush_qqbuf()) return &resp_no_write;
     close(qqmpipe[1]);
     qqmpipe[1] = -1;
   }
@@ -229,25 +795,54 @@ static const response* message_end(int fd)
     if (fstat(fd, &st) != 0)
       return &resp_internal;
     databytes = st.st_size;
-    if (start_qq(fd, qqepipe[0]) == -1)
+#ifdef POSIX_FADV_SEQUENTIAL
+    /* qmail-queue reads it straight through, start the readahead now */
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#endif
+    if (med_count()) {
+      if (pipe(qqmpipe) == -1) return &resp_no_pipe;
+      size_pipe(qqmpipe[1]);
+      if (start_qq(qqmpipe[0], qqepipe[0]) == -1)
+	return &resp_no_fork;
+      close(qqmpipe[0]);
+      qqmpipe[0] = -1;
+      databytes = med_size(st.st_size);
+      if (!med_write(qqmpipe[1], fd, st.st_size))
+	return &resp_no_write;
+      qqwrites += med_calls();
+      close(qqmpipe[1]);
+      qqmpipe[1] = -1;
+    }
+    else if (start_qq(fd, qqepipe[0]) == -1)
       return &resp_no_fork;
   }
-  if (!retry_write(qqepipe[1], buffer.s, buffer.len+1)) return &resp_no_write;
+  if (!retry_write(qqsock != -1 ? qqsock : qqepipe[1], buffer.s, buffer.len+1))
+    return &resp_no_write;
   close_qqpipe();
-  if (waitpid(qqpid, &status, WUNTRACED) == -1) return &resp_qq_crashed;
-  if (!WIFEXITED(status)) return &resp_qq_crashed;
+  if ((status = wait_qq()) == -1) return &resp_qq_crashed;
+
+  if (session_getenv("QQTIMING"))
+    msg2("qq usec ", utoa(usec_since(&start)));
+  if (session_getenv("QQSTATS")) {
+    unsigned long usec = usec_since(&datastart);
+
+    str_copys(&qqbuf, "qq stats bytes ");
+    str_catu(&qqbuf, databytes);
+    str_cats(&qqbuf, " writes ");
+    str_catu(&qqbuf, qqwrites);
+    str_cats(&qqbuf, " usec ");
+    str_catu(&qqbuf, usec);
+    str_cats(&qqbuf, " bytes/sec ");
+    str_catu(&qqbuf, usec ? (unsigned long)(databytes * 1e6 / usec) : 0);
+    msg1(qqbuf.s);
+  }
 
-  if ((status = WEXITSTATUS(status)) != 0)
+  if (status != 0)
     parse_status(status, &resp);
-  else if(session_getnum("sump",0)) {
-    char *sumpmsg = (char *)session_getenv("RBLSMTPD");
-
-    if(!sumpmsg) sumpmsg = "5.3.0 Message refused.";
-    if(*sumpmsg == '-') sumpmsg++; /* always reject */
-    msg2("sump reject: ", sumpmsg);
-    resp.number = 553;
-    resp.message = sumpmsg;
-  } else {
+  else if(session_getnum("sump",0))
+    sump_reject(&resp);
+  else {
     str_copys(&buffer, "2.6.0 Accepted message qp ");
     str_catu(&buffer, qqpid);
     str_cats(&buffer, " bytes ");
@@ -256,6 +851,7 @@ static const response* message_end(int fd)
     resp.number = 250;
     resp.message = buffer.s;
   }
+  if (status == 0) dedup_store(&resp);
   return &resp;
 }
 
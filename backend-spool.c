@@ -0,0 +1,374 @@
+/*
+ * backend-spool, accepts mail into a local spool log and lets
+ * spoolfeed hand it to qmail-queue later
+ *
+ * SPOOLDIR: directory of the spool, must exist
+ * SPOOLSEGSIZE: start a new log past this size, default 64M
+ *
+ * Messages are appended to log.N, each record being
+ *   "MFSPOOL1 envlen msglen\n" envelope message "\nEND\n"
+ * where the envelope is in qmail-queue's format.  Sessions append
+ * under a lock, then fdatasync the log in group commits: whoever gets
+ * the sync lock first syncs everything appended so far, and the others
+ * find their records already durable when they get it.  The 250 is only
+ * given once the record is durable.  spoolfeed only feeds durable
+ * records, and a record that couldn't be synced is marked "MFSPOOLX"
+ * before the sync lock is let go, so spoolfeed skips it even once a
+ * later sync covers it, and the 451 the client got holds.
+ *
+ * Header edits plugins noted in the msgedit journal are made as the
+ * message is copied from the spool file into the log.
+ *
+ * The file "state" holds the current log number and how far it's known
+ * to be durable.  It's synced whenever the log number moves on, so the
+ * number never goes back.
+ *
+ * With plugin-dedup, 250s are kept under the session's msghash for
+ * DEDUPTTL seconds (default 600), as backend-qmailsump does, and a
+ * message it marks dupmsg gets the stored response without being
+ * spooled, or a 451 if that has expired since.
+ *
+ * Sump mail isn't handled: a sump session (RELAYCLIENT the same as
+ * SUMPDOMAIN) gets a 451 at MAIL FROM, use backend-qmailsump for it.
+ */
+#include <sysdeps.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <misc/misc.h>
+#include <msg/msg.h>
+#include "mailfront.h"
+
+extern off_t med_size(off_t size);
+extern int med_write(int out, int fd, off_t size);
+extern void med_reset(void);
+extern void mh_reset(void);
+extern int shm_open_table(const char *name, unsigned nslots, unsigned vsize);
+extern int shm_fetch(int t, const char *key, unsigned klen, void *val);
+extern int shm_store(int t, const char *key, unsigned klen, const void *val, unsigned ttl);
+
+static RESPONSE(no_spool,451,"4.3.0 Could not open the spool.");
+static RESPONSE(no_write,451,"4.3.0 Writing to the spool failed.");
+static RESPONSE(no_sync,451,"4.3.0 Syncing the spool failed.");
+static RESPONSE(no_sump,451,"4.3.0 Sump mail can't be spooled.");
+static RESPONSE(dup_lost,451,"4.3.0 Lost the answer to the first copy, try again.");
+
+/* same as backend-qmailsump and plugin-dedup */
+struct dedupresp {
+  unsigned number;
+  char message[256];
+};
+
+struct spoolstate {
+  uint32_t seg;			/* log being appended to */
+  uint32_t durseg;		/* log of durable position */
+  uint64_t durable;		/* synced up to here in durseg */
+};
+
+static str envelope;
+static str message;		/* when there's no file */
+static int spoolfile;		/* message is in the spool file */
+static int spooldir = -1;
+static int lockfd = -1;		/* held while appending */
+static int statefd = -1;	/* held while syncing */
+static struct spoolstate *state;
+static int deduptab = -2;
+
+static const response* init(void)
+{
+  session_setnum("msgedit", 1);	/* we apply the msgedit journal */
+  return 0;
+}
+
+static const response* reset(void)
+{
+  str_truncate(&envelope, 0);
+  str_truncate(&message, 0);
+  med_reset();
+  mh_reset();
+  return 0;
+}
+
+static const response* do_sender(str* sender, str* params)
+{
+  const char *sump = session_getenv("SUMPDOMAIN");
+  const char *rc = session_getenv("RELAYCLIENT");
+
+  /* backend-qmailsump's faux reject and SUMPADDR routing aren't here,
+     so don't queue it as if it were ordinary mail */
+  if (sump && rc && !strcmp(sump, rc)) {
+    msg1("sump session, use backend-qmailsump");
+    return &resp_no_sump;
+  }
+  if (!str_catc(&envelope, 'F') ||
+      !str_cat(&envelope, sender) ||
+      !str_catc(&envelope, 0)) return &resp_oom;
+  return 0;
+  (void)params;
+}
+
+static const response* do_recipient(str* recipient, str* params)
+{
+  if (!str_catc(&envelope, 'T') ||
+      !str_cat(&envelope, recipient) ||
+      !str_catc(&envelope, 0)) return &resp_oom;
+  return 0;
+  (void)params;
+}
+
+static int open_spool(void)
+{
+  const char *dir;
+
+  if (state) return 1;
+  if ((dir = session_getenv("SPOOLDIR")) == 0) return 0;
+  if ((spooldir = open(dir, O_RDONLY|O_DIRECTORY)) == -1) return 0;
+  if ((lockfd = openat(spooldir, "lock", O_RDWR|O_CREAT, 0600)) == -1
+      || (statefd = openat(spooldir, "state", O_RDWR|O_CREAT, 0600)) == -1)
+    return 0;
+  if (flock(statefd, LOCK_EX) != 0) return 0;
+  if (ftruncate(statefd, sizeof *state) != 0) { /* no-op if it's there */
+    flock(statefd, LOCK_UN);
+    return 0;
+  }
+  flock(statefd, LOCK_UN);
+  state = mmap(0, sizeof *state, PROT_READ|PROT_WRITE, MAP_SHARED, statefd, 0);
+  if (state == MAP_FAILED) {
+    state = 0;
+    return 0;
+  }
+  return 1;
+}
+
+static int open_log(uint32_t seg, int flags)
+{
+  char name[32];
+
+  strcpy(name, "log.");
+  strcpy(name+4, utoa(seg));
+  return openat(spooldir, name, flags, 0600);
+}
+
+static const response* data_start(int fd)
+{
+  if (!open_spool()) return &resp_no_spool;
+  spoolfile = fd >= 0;
+  return 0;
+}
+
+static const response* data_block(const char* bytes, unsigned long len)
+{
+  if (!spoolfile && !str_catb(&message, bytes, len)) return &resp_oom;
+  return 0;
+}
+
+/* append the record, returns its log, start and end */
+static const response* append(int fd, uint32_t* seg, uint64_t* start,
+			      uint64_t* end, unsigned long* msglenp)
+{
+  static str hdr;
+  const char *s;
+  unsigned long segsize = 64UL*1024*1024;
+  unsigned long msglen;
+  off_t filesize = 0;
+  struct stat st;
+  struct iovec iov[4];
+  int logfd = -1;
+  const response *resp = &resp_no_write;
+
+  if (fd >= 0) {
+    if (fstat(fd, &st) != 0) return &resp_internal;
+    filesize = st.st_size;
+    msglen = med_size(filesize);
+  }
+  else
+    msglen = message.len;
+  if ((s = session_getenv("SPOOLSEGSIZE")) != 0) segsize = strtoul(s, 0, 10);
+
+  if (!str_copys(&hdr, "MFSPOOL1 ") ||
+      !str_catu(&hdr, envelope.len+1) ||
+      !str_catc(&hdr, ' ') ||
+      !str_catu(&hdr, msglen) ||
+      !str_catc(&hdr, LF)) return &resp_oom;
+
+  if (flock(lockfd, LOCK_EX) != 0) return &resp_internal;
+  for (;;) {
+    /* not O_APPEND, sendfile won't write to that; the lock keeps order */
+    if ((logfd = open_log(state->seg, O_WRONLY|O_CREAT)) == -1
+	|| fstat(logfd, &st) != 0)
+      goto done;
+    if (st.st_size == 0 && fsync(spooldir) != 0) /* new log, make it stick */
+      goto done;
+    if ((unsigned long)st.st_size < segsize) break;
+    /* full, everything in it has to be durable before moving on */
+    if (fdatasync(logfd) != 0) goto done;
+    close(logfd);
+    logfd = -1;
+    state->seg++;
+    /* on disk before the next log is, or a crash could take us back
+       to this one, behind where spoolfeed has got to */
+    if (msync(state, sizeof *state, MS_SYNC) != 0) {
+      state->seg--;
+      goto done;
+    }
+  }
+  if (lseek(logfd, st.st_size, SEEK_SET) != st.st_size) goto done;
+
+  iov[0].iov_base = hdr.s;
+  iov[0].iov_len = hdr.len;
+  iov[1].iov_base = envelope.s;
+  iov[1].iov_len = envelope.len+1;
+  iov[2].iov_base = message.s;
+  iov[2].iov_len = fd >= 0 ? 0 : message.len;
+  iov[3].iov_base = "\nEND\n";
+  iov[3].iov_len = 5;
+  if (fd >= 0) {
+    /* header and envelope, message straight from the file, trailer */
+    if (writev(logfd, iov, 2) != (ssize_t)(iov[0].iov_len + iov[1].iov_len)
+	|| !med_write(logfd, fd, filesize)
+	|| write(logfd, iov[3].iov_base, 5) != 5)
+      goto undo;
+  }
+  else if (writev(logfd, iov, 4)
+	   != (ssize_t)(iov[0].iov_len + iov[1].iov_len + iov[2].iov_len + 5))
+    goto undo;
+
+  *seg = state->seg;
+  *start = st.st_size;
+  *end = st.st_size + hdr.len + envelope.len+1 + msglen + 5;
+  *msglenp = msglen;
+  resp = 0;
+  goto done;
+
+ undo:
+  /* don't leave half a record in front of the next one */
+  if (ftruncate(logfd, st.st_size) != 0) { }
+ done:
+  if (logfd != -1) close(logfd);
+  flock(lockfd, LOCK_UN);
+  return resp;
+}
+
+/* mark the record at start in seg as not to be fed, it got a 451 */
+static void withdraw(uint32_t seg, uint64_t start)
+{
+  int logfd;
+
+  if ((logfd = open_log(seg, O_WRONLY)) == -1
+      || pwrite(logfd, "X", 1, start + 7) != 1)
+    msg1("can't withdraw spool record, it may be queued twice");
+  if (logfd != -1) close(logfd);
+}
+
+/* wait until the log is durable up to seg/end, withdraw the record
+   from start if it can't be made so */
+static const response* group_commit(uint32_t seg, uint64_t start, uint64_t end)
+{
+  struct stat st;
+  uint32_t cur;
+  int logfd;
+  const response *resp = 0;
+
+  if (flock(statefd, LOCK_EX) != 0) return &resp_internal;
+  if (state->durseg > seg || (state->durseg == seg && state->durable >= end))
+    goto done;			/* someone synced it for us */
+
+  /* sync everything appended so far, not just ours */
+  cur = state->seg;
+  if ((logfd = open_log(cur, O_RDONLY)) == -1) {
+    resp = &resp_no_sync;
+    goto done;
+  }
+  if (fstat(logfd, &st) != 0 || fdatasync(logfd) != 0)
+    resp = &resp_no_sync;
+  else {
+    state->durseg = cur;
+    state->durable = st.st_size;
+  }
+  close(logfd);
+
+ done:
+  /* before anyone else can sync it and move the durable mark past it */
+  if (resp) withdraw(seg, start);
+  flock(statefd, LOCK_UN);
+  return resp;
+}
+
+/* answer a client retry the same as the first copy, or if that answer
+   has gone, 451 so the retry is scanned, the scanners skipped this one */
+static const response* dedup_fetch(void)
+{
+  static struct dedupresp dr;
+  static response resp;
+  const char *key = session_getstr("msghash");
+
+  if (deduptab == -2) deduptab = shm_open_table("dedup", 4096, sizeof dr);
+  if (!key || !*key || !shm_fetch(deduptab, key, strlen(key), &dr)) {
+    msg1("duplicate, but the first copy's answer is gone, not spooled");
+    return &resp_dup_lost;
+  }
+  msg2("duplicate, not spooled: ", dr.message);
+  resp.number = dr.number;
+  resp.message = dr.message;
+  return &resp;
+}
+
+static void dedup_store(const response* resp)
+{
+  struct dedupresp dr;
+  const char *key = session_getstr("msghash");
+  const char *s;
+  unsigned long ttl = 600;
+
+  if (!key || !*key) return;
+  if ((s = session_getenv("DEDUPTTL")) != 0) ttl = strtoul(s, 0, 10);
+  memset(&dr, 0, sizeof dr);
+  dr.number = resp->number;
+  strncpy(dr.message, resp->message, sizeof dr.message - 1);
+  if (deduptab == -2) deduptab = shm_open_table("dedup", 4096, sizeof dr);
+  shm_store(deduptab, key, strlen(key), &dr, ttl);
+}
+
+static const response* message_end(int fd)
+{
+  static response resp;
+  static str buffer;
+  const response *r;
+  uint32_t seg;
+  uint64_t start, end;
+  unsigned long msglen;
+
+  if (session_getnum("dupmsg", 0)) return dedup_fetch();
+  if (!state) return &resp_no_spool;
+  if ((r = append(fd, &seg, &start, &end, &msglen)) != 0) return r;
+  if ((r = group_commit(seg, start, end)) != 0) return r;
+
+  str_copys(&buffer, "2.6.0 Accepted message spool ");
+  str_catu(&buffer, seg);
+  str_catc(&buffer, '.');
+  str_catu(&buffer, end);
+  str_cats(&buffer, " bytes ");
+  str_catu(&buffer, msglen);
+  msg1(buffer.s);
+  resp.number = 250;
+  resp.message = buffer.s;
+  dedup_store(&resp);
+  return &resp;
+}
+
+struct plugin backend = {
+  .version = PLUGIN_VERSION,
+  .init = init,
+  .reset = reset,
+  .sender = do_sender,
+  .recipient = do_recipient,
+  .data_start = data_start,
+  .data_block = data_block,
+  .message_end = message_end,
+};
@@ -0,0 +1,121 @@
+/*
+ * Circuit breakers for the external daemons, shared by all sessions
+ * so one sick daemon doesn't stall every SMTP session waiting on it
+ *
+ * brk_allow(const char *name) -> 1 to call the daemon, 0 to skip it
+ * brk_report(const char *name, int ok, unsigned long ms, unsigned long slowms)
+ *   after each call that brk_allow let through, ok is 0 for errors and
+ *   timeouts, calls taking more than slowms count as slow
+ *
+ * A breaker opens when at least BREAKER_MINCALLS (default 10) calls in
+ * BREAKER_WINDOW seconds (default 60) have BREAKER_FAILPCT percent
+ * (default 50) errors or slow responses.  After BREAKER_OPEN seconds
+ * (default 30) one probe call is let through, and the breaker closes
+ * if it works or stays open another BREAKER_OPEN seconds if it doesn't.
+ *
+ * State is in the shared table "breaker", see shmtab
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <msg/msg.h>
+#include <str/str.h>
+
+extern int shm_open_table(const char *name, unsigned nslots, unsigned vsize);
+extern int shm_lock(int t);
+extern int shm_unlock(int t);
+extern void* shm_find(int t, const char *key, unsigned klen, int create, unsigned ttl);
+extern void shm_expire(int t, void *val, unsigned ttl);
+
+#define BRK_CLOSED 0
+#define BRK_OPEN 1
+#define BRK_HALFOPEN 2
+
+#define BRK_TTL 86400		/* forget idle breakers after a day */
+
+struct breaker {
+  int state;
+  time_t wstart;		/* start of counting window */
+  unsigned calls;
+  unsigned bad;			/* errors plus slow calls */
+  time_t until;			/* open until, or probe expires */
+};
+
+static int brktab = -2;
+
+static unsigned long envnum(const char *name, unsigned long dflt)
+{
+  const char *s = getenv(name);
+
+  return s ? strtoul(s, 0, 10) : dflt;
+}
+
+static struct breaker* brk_get(const char *name)
+{
+  if(brktab == -2) brktab = shm_open_table("breaker", 64, sizeof(struct breaker));
+  if(brktab < 0 || !shm_lock(brktab)) return 0;
+  return shm_find(brktab, name, strlen(name), 1, BRK_TTL);
+}
+
+int brk_allow(const char *name)
+{
+  struct breaker *b;
+  time_t now = time(0);
+  int ok = 1;
+
+  if((b = brk_get(name)) == 0) return 1; /* no state, no breaker */
+
+  switch(b->state) {
+  case BRK_OPEN:
+    if(now < b->until) ok = 0;
+    else {			/* let one probe through */
+      b->state = BRK_HALFOPEN;
+      b->until = now + envnum("BREAKER_OPEN", 30);
+      msg3("breaker ", name, " half open");
+    }
+    break;
+  case BRK_HALFOPEN:
+    if(now < b->until) ok = 0;	/* probe still out */
+    else b->until = now + envnum("BREAKER_OPEN", 30); /* probe lost, try again */
+    break;
+  }
+  shm_expire(brktab, b, BRK_TTL);
+  shm_unlock(brktab);
+  return ok;
+}
+
+void brk_report(const char *name, int ok, unsigned long ms, unsigned long slowms)
+{
+  struct breaker *b;
+  time_t now = time(0);
+  int bad = !ok || (slowms && ms > slowms);
+
+  if((b = brk_get(name)) == 0) return;
+
+  if(b->state != BRK_CLOSED) {
+    if(bad) {
+      b->state = BRK_OPEN;
+      b->until = now + envnum("BREAKER_OPEN", 30);
+    } else {
+      b->state = BRK_CLOSED;
+      b->wstart = now;
+      b->calls = b->bad = 0;
+      msg3("breaker ", name, " closed");
+    }
+  } else {
+    if(now - b->wstart >= (time_t)envnum("BREAKER_WINDOW", 60)) {
+      b->wstart = now;
+      b->calls = b->bad = 0;
+    }
+    b->calls++;
+    if(bad) b->bad++;
+    if(b->calls >= envnum("BREAKER_MINCALLS", 10)
+       && b->bad*100 >= b->calls*envnum("BREAKER_FAILPCT", 50)) {
+      b->state = BRK_OPEN;
+      b->until = now + envnum("BREAKER_OPEN", 30);
+      msg3("breaker ", name, " open");
+    }
+  }
+  shm_unlock(brktab);
+}
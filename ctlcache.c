@@ -0,0 +1,359 @@
+/*
+ * Shared compiled cache of control/ list files
+ * Separate module so every plugin shares one copy per process
+ *
+ * ctl_lookup(const char *file, str *key)
+ *  -> 1 if key is in the list, 0 if not, -1 for error
+ * file is relative to QMAILHOME, e.g. "control/nosafilter"
+ *
+ * ctl_lookupval(const char *file, str *key, str *val)
+ *  -> 1 with the rest of the line in val if there's a "key:rest" line,
+ *     0 if not, -1 for error
+ *
+ * Each list is compiled once into a hash index file in the state
+ * directory (see shm_statedir in shmtab.c) which every process maps
+ * read-only.  The index remembers the device, inode, size, and mtime
+ * of the source, and is rebuilt by whoever notices that the source has
+ * changed, or that the index isn't ours or has slots pointing outside
+ * it.  The source is stat'ed at most once a second per process, so
+ * lookups normally do no I/O at all.
+ *
+ * List format is the same as dict_load_list: one entry per line,
+ * surrounding white space stripped, blank lines and # comments ignored
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <iobuf/ibuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include "conf_qmail.c"
+
+extern const char* shm_statedir(void);
+extern int shm_safefile(int fd);
+
+#define CTLMAGIC "mfctl02"
+#define CTLMAX 16		/* lists we keep open */
+
+struct ctlhdr {
+  char magic[8];
+  uint64_t dev, ino, size;
+  int64_t mtime, mtimens;
+  uint32_t nslots;		/* power of 2 */
+  uint32_t nrecs;
+};
+
+struct ctlslot {
+  uint32_t hash;
+  uint32_t pos;			/* offset of record, 0 if empty */
+};
+
+/* a second slot table follows, hashed on the line up to the first :
+ * for ctl_lookupval; records are a uint32_t length followed by the line */
+
+struct ctlfile {
+  str name;			/* as passed to ctl_lookup */
+  str src;			/* full path of source */
+  str idx;			/* full path of index */
+  const char *map;		/* mapped index or private copy */
+  size_t maplen;
+  int mapped;
+  time_t checked;
+  struct stat st;
+};
+
+static struct ctlfile ctlfiles[CTLMAX];
+static int nctlfiles;
+
+static uint32_t ctl_hash(const char *s, unsigned len)
+{
+  uint32_t h = 2166136261U;
+
+  while(len--) {
+    h ^= (unsigned char)*s++;
+    h *= 16777619U;
+  }
+  return h;
+}
+
+static void ctl_unmap(struct ctlfile *cf)
+{
+  if(cf->map) {
+    if(cf->mapped) munmap((void *)cf->map, cf->maplen);
+    else free((void *)cf->map);
+  }
+  cf->map = 0;
+  cf->maplen = 0;
+}
+
+static int ctl_current(const struct ctlfile *cf, const char *map, size_t len)
+{
+  const struct ctlhdr *h = (const struct ctlhdr *)map;
+
+  if(len < sizeof *h || memcmp(h->magic, CTLMAGIC, 8)) return 0;
+  return h->dev == (uint64_t)cf->st.st_dev
+    && h->ino == (uint64_t)cf->st.st_ino
+    && h->size == (uint64_t)cf->st.st_size
+    && h->mtime == (int64_t)cf->st.st_mtim.tv_sec
+    && h->mtimens == (int64_t)cf->st.st_mtim.tv_nsec;
+}
+
+/* every slot of both tables points at a whole record inside the map */
+static int ctl_valid(const char *map, size_t len)
+{
+  const struct ctlhdr *h = (const struct ctlhdr *)map;
+  const struct ctlslot *slots;
+  uint64_t start;
+  uint32_t i, l, empty[2] = { 0, 0 };
+
+  if(h->nslots == 0 || (h->nslots & (h->nslots-1))) return 0;
+  start = sizeof *h + 2*(uint64_t)h->nslots*sizeof *slots;
+  if(start > len) return 0;
+  slots = (const struct ctlslot *)(map + sizeof *h);
+  for(i = 0; i < 2*h->nslots; i++) {
+    if(!slots[i].pos) {
+      empty[i >= h->nslots]++;	/* so probes stop */
+      continue;
+    }
+    if(slots[i].pos < start || slots[i].pos + (uint64_t)sizeof l > len) return 0;
+    memcpy(&l, map+slots[i].pos, sizeof l);
+    if(slots[i].pos + (uint64_t)sizeof l + l > len) return 0;
+  }
+  return empty[0] && empty[1];
+}
+
+/* compile the source into an index in out */
+static int ctl_compile(struct ctlfile *cf, str *out)
+{
+  struct ctlhdr h;
+  struct ctlslot *slots, *vslots;
+  str line, recs;
+  ibuf in;
+  unsigned nslots = 16;
+  unsigned i;
+
+  if(!str_init(&line) || !str_init(&recs)) return 0;
+  memset(&h, 0, sizeof h);
+
+  if(ibuf_open(&in, cf->src.s, 0)) {
+    while(ibuf_getstr(&in, &line, '\n')) {
+      uint32_t l;
+
+      str_strip(&line);
+      if(line.len == 0 || line.s[0] == '#') continue;
+      l = line.len;
+      if(!str_catb(&recs, (char *)&l, sizeof l) || !str_cat(&recs, &line)) {
+	ibuf_close(&in);
+	return 0;
+      }
+      h.nrecs++;
+    }
+    ibuf_close(&in);
+  } else if(errno != ENOENT)
+    return 0;
+
+  while(nslots < 2*h.nrecs) nslots <<= 1;
+  memcpy(h.magic, CTLMAGIC, 8);
+  h.dev = cf->st.st_dev;
+  h.ino = cf->st.st_ino;
+  h.size = cf->st.st_size;
+  h.mtime = cf->st.st_mtim.tv_sec;
+  h.mtimens = cf->st.st_mtim.tv_nsec;
+  h.nslots = nslots;
+
+  if(!str_ready(out, sizeof h + 2*nslots*sizeof *slots + recs.len)) return 0;
+  memcpy(out->s, &h, sizeof h);
+  slots = (struct ctlslot *)(out->s + sizeof h);
+  vslots = slots + nslots;
+  memset(slots, 0, 2*nslots*sizeof *slots);
+  out->len = sizeof h + 2*nslots*sizeof *slots;
+
+  for(i = 0; i < recs.len; ) {
+    uint32_t l, hash, j;
+
+    const char *colon;
+
+    memcpy(&l, recs.s+i, sizeof l);
+    hash = ctl_hash(recs.s+i+sizeof l, l);
+    for(j = hash & (nslots-1); slots[j].pos; j = (j+1) & (nslots-1))
+      ;
+    slots[j].hash = hash;
+    slots[j].pos = out->len + i;
+
+    colon = memchr(recs.s+i+sizeof l, ':', l);
+    hash = ctl_hash(recs.s+i+sizeof l, colon ? (unsigned)(colon - (recs.s+i+sizeof l)) : l);
+    for(j = hash & (nslots-1); vslots[j].pos; j = (j+1) & (nslots-1))
+      ;
+    vslots[j].hash = hash;
+    vslots[j].pos = out->len + i;
+    i += sizeof l + l;
+  }
+  memcpy(out->s+out->len, recs.s, recs.len);
+  out->len += recs.len;
+  str_free(&line);
+  str_free(&recs);
+  return 1;
+}
+
+/* map the index, rebuilding it if it's stale */
+static int ctl_load(struct ctlfile *cf)
+{
+  struct stat ist;
+  str tmp, built;
+  void *m;
+  int fd;
+
+  ctl_unmap(cf);
+
+  if((fd = open(cf->idx.s, O_RDONLY|O_NOFOLLOW)) >= 0) {
+    if(shm_safefile(fd) && fstat(fd, &ist) == 0 && ist.st_size > 0) {
+      m = mmap(0, ist.st_size, PROT_READ, MAP_SHARED, fd, 0);
+      if(m != MAP_FAILED) {
+	if(ctl_current(cf, m, ist.st_size) && ctl_valid(m, ist.st_size)) {
+	  close(fd);
+	  cf->map = m;
+	  cf->maplen = ist.st_size;
+	  cf->mapped = 1;
+	  return 1;
+	}
+	munmap(m, ist.st_size);
+      }
+    }
+    close(fd);
+  }
+
+  /* stale or missing, make a new one */
+  str_init(&built);
+  if(!ctl_compile(cf, &built)) {
+    str_free(&built);
+    return 0;
+  }
+
+  str_init(&tmp);
+  str_copy(&tmp, &cf->idx);
+  str_catc(&tmp, '.');
+  str_catu(&tmp, getpid());
+  unlink(tmp.s);			/* left by a dead process with our pid */
+  if((fd = open(tmp.s, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0644)) >= 0) {
+    if(write(fd, built.s, built.len) != (ssize_t)built.len
+       || close(fd) != 0
+       || rename(tmp.s, cf->idx.s) != 0)
+      unlink(tmp.s);
+  } else
+    msg2("can't write control cache ", tmp.s);
+  str_free(&tmp);
+
+  /* use our private copy either way, the shared one next time */
+  cf->map = built.s;
+  cf->maplen = built.len;
+  cf->mapped = 0;
+  return 1;
+}
+
+static struct ctlfile* ctl_find(const char *file)
+{
+  struct ctlfile *cf;
+  const char *qh;
+  const char *dir;
+  int i;
+
+  for(i = 0; i < nctlfiles; i++)
+    if(!str_diffs(&ctlfiles[i].name, file)) return &ctlfiles[i];
+  if(nctlfiles >= CTLMAX) return 0;
+
+  cf = &ctlfiles[nctlfiles];
+  if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+  if((dir = shm_statedir()) == 0) return 0;
+  if(!str_init(&cf->name) || !str_copys(&cf->name, file)) return 0;
+  if(!str_init(&cf->src) || !str_copy3s(&cf->src, qh, "/", file)) return 0;
+
+  /* index name is the source path with / turned into _ */
+  if(!str_init(&cf->idx) || !str_copy2s(&cf->idx, dir, "/ctl")) return 0;
+  for(i = 0; i < (int)cf->src.len; i++)
+    if(!str_catc(&cf->idx, cf->src.s[i] == '/' ? '_' : cf->src.s[i])) return 0;
+  if(!str_cats(&cf->idx, ".idx")) return 0;
+
+  nctlfiles++;
+  return cf;
+}
+
+/* the list's index, rebuilt if the source has changed */
+static struct ctlfile* ctl_open(const char *file)
+{
+  struct ctlfile *cf = ctl_find(file);
+  time_t now = time(0);
+
+  if(!cf) return 0;
+
+  if(!cf->map || now != cf->checked) {
+    struct stat st;
+
+    cf->checked = now;
+    if(stat(cf->src.s, &st) != 0) {
+      if(errno != ENOENT) return 0;
+      memset(&st, 0, sizeof st); /* missing is an empty list */
+    }
+    if(!cf->map || st.st_dev != cf->st.st_dev || st.st_ino != cf->st.st_ino
+       || st.st_size != cf->st.st_size
+       || st.st_mtim.tv_sec != cf->st.st_mtim.tv_sec
+       || st.st_mtim.tv_nsec != cf->st.st_mtim.tv_nsec) {
+      cf->st = st;
+      if(!ctl_load(cf)) return 0;
+    }
+  }
+  return cf;
+}
+
+int ctl_lookup(const char *file, str *key)
+{
+  struct ctlfile *cf = ctl_open(file);
+  const struct ctlhdr *h;
+  const struct ctlslot *slots;
+  uint32_t hash, j;
+
+  if(!cf) return -1;
+  h = (const struct ctlhdr *)cf->map;
+  slots = (const struct ctlslot *)(cf->map + sizeof *h);
+  hash = ctl_hash(key->s, key->len);
+  for(j = hash & (h->nslots-1); slots[j].pos; j = (j+1) & (h->nslots-1)) {
+    uint32_t l;
+
+    if(slots[j].hash != hash) continue;
+    memcpy(&l, cf->map+slots[j].pos, sizeof l);
+    if(l == key->len && !memcmp(cf->map+slots[j].pos+sizeof l, key->s, l))
+      return 1;
+  }
+  return 0;
+}
+
+int ctl_lookupval(const char *file, str *key, str *val)
+{
+  struct ctlfile *cf = ctl_open(file);
+  const struct ctlhdr *h;
+  const struct ctlslot *vslots;
+  uint32_t hash, j;
+
+  if(!cf) return -1;
+  h = (const struct ctlhdr *)cf->map;
+  vslots = (const struct ctlslot *)(cf->map + sizeof *h) + h->nslots;
+  hash = ctl_hash(key->s, key->len);
+  for(j = hash & (h->nslots-1); vslots[j].pos; j = (j+1) & (h->nslots-1)) {
+    const char *rec;
+    uint32_t l;
+
+    if(vslots[j].hash != hash) continue;
+    memcpy(&l, cf->map+vslots[j].pos, sizeof l);
+    rec = cf->map+vslots[j].pos+sizeof l;
+    if(l > key->len && rec[key->len] == ':' && !memcmp(rec, key->s, key->len))
+      return str_copyb(val, rec+key->len+1, l-key->len-1) ? 1 : -1;
+  }
+  return 0;
+}
@@ -0,0 +1,207 @@
+/*
+ * Edit journal for the spooled message
+ * Separate module so every plugin shares one copy per process
+ *
+ * Plugins that add or drop header lines note the edits here against
+ * byte offsets in the message as received, rather than each copying
+ * the message to a scratch file with its change.  The backend then
+ * writes the edited message once, as it hands it on, stitching the
+ * untouched ranges of the spool file (with sendfile) around the new
+ * text.
+ *
+ * med_insert(off_t off, const char *text, unsigned long len)
+ *  text goes in before original byte off; inserts at the same place
+ *  come out in the order they were made
+ * med_delete(off_t off, off_t len) original bytes off..off+len go away,
+ *  overlapping deletes are fine
+ *  -> 1 for OK, 0 for out of memory
+ * med_count() -> number of edits noted
+ * med_size(off_t size) -> size of the edited message, size the original
+ * med_write(int out, int fd, off_t size)
+ *  -> 1 with the edited message written to out, 0 for error
+ * med_calls() -> write and sendfile calls the last med_write made
+ * med_reset() forget them all, for the next message
+ * med_check() -> 1 if the backend makes the edits, 0 with a log message
+ *  if it doesn't, so plugins can refuse the message rather than have
+ *  their edits silently lost
+ *
+ * The original file isn't changed, so plugins that read it later see
+ * the message as received, not with earlier plugins' edits.
+ * Only backends that call med_write make the edits, backend-qmailsump
+ * and backend-spool; they say so by setting session number "msgedit"
+ * in their init.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/sendfile.h>
+#include "mailfront.h"
+#include <str/str.h>
+#include <msg/msg.h>
+
+struct medit {
+  off_t off;
+  off_t len;			/* bytes deleted, 0 for an insert */
+  unsigned long text;		/* offset in medtext */
+  unsigned long tlen;
+  unsigned seq;
+};
+
+static struct medit *edits;
+static unsigned nedits;
+static unsigned maxedits;
+static str medtext;
+static unsigned long medcalls;	/* by the last med_write */
+
+static int med_add(off_t off, off_t len, const char *text, unsigned long tlen)
+{
+  struct medit *e;
+
+  if(nedits == maxedits) {
+    unsigned n = maxedits ? 2 * maxedits : 16;
+    struct medit *ne = realloc(edits, n * sizeof *ne);
+
+    if(!ne) return 0;
+    edits = ne;
+    maxedits = n;
+  }
+  e = &edits[nedits];
+  e->off = off;
+  e->len = len;
+  e->text = medtext.len;
+  e->tlen = tlen;
+  e->seq = nedits;
+  if(tlen && !str_catb(&medtext, text, tlen)) return 0;
+  nedits++;
+  return 1;
+}
+
+int med_insert(off_t off, const char *text, unsigned long len)
+{
+  if(!len) return 1;
+  return med_add(off, 0, text, len);
+}
+
+int med_delete(off_t off, off_t len)
+{
+  if(len <= 0) return 1;
+  return med_add(off, len, 0, 0);
+}
+
+int med_count(void)
+{
+  return nedits;
+}
+
+void med_reset(void)
+{
+  nedits = 0;
+  str_truncate(&medtext, 0);
+}
+
+int med_check(void)
+{
+  if(session_getnum("msgedit", 0)) return 1;
+  msg1("backend doesn't apply msgedit header edits, "
+       "use backend-qmailsump or backend-spool");
+  return 0;
+}
+
+/* by place, inserts before deletes, then as made */
+static int med_cmp(const void *a, const void *b)
+{
+  const struct medit *x = a;
+  const struct medit *y = b;
+
+  if(x->off != y->off) return x->off < y->off ? -1 : 1;
+  if(!x->len != !y->len) return x->len ? 1 : -1;
+  return x->seq < y->seq ? -1 : 1;
+}
+
+off_t med_size(off_t size)
+{
+  off_t pos = 0;
+  off_t n = size;
+  unsigned i;
+
+  qsort(edits, nedits, sizeof *edits, med_cmp);
+  for(i = 0; i < nedits; i++) {
+    const struct medit *e = &edits[i];
+
+    if(!e->len)
+      n += e->tlen;
+    else {
+      off_t start = e->off > pos ? e->off : pos;
+      off_t end = e->off + e->len > size ? size : e->off + e->len;
+
+      if(end > start) n -= end - start;
+      if(end > pos) pos = end;
+    }
+  }
+  return n;
+}
+
+static int write_all(int out, const char *s, unsigned long len)
+{
+  ssize_t w;
+
+  while(len) {
+    medcalls++;
+    if((w = write(out, s, len)) < 0) {
+      if(errno == EINTR) continue;
+      return 0;
+    }
+    s += w;
+    len -= w;
+  }
+  return 1;
+}
+
+/* original bytes from *pos up to end */
+static int copy_range(int out, int fd, off_t *pos, off_t end)
+{
+  char buf[65536];
+  ssize_t w;
+
+  while(*pos < end) {
+    medcalls++;
+    if((w = sendfile(out, fd, pos, end - *pos)) > 0) continue;
+    if(w < 0 && errno == EINTR) continue;
+    if(w == 0 || (errno != EINVAL && errno != ENOSYS)) return 0;
+    /* out is something sendfile can't do, copy the slow way */
+    if((w = pread(fd, buf, end - *pos < (off_t)sizeof buf ? end - *pos : (off_t)sizeof buf, *pos)) <= 0
+       || !write_all(out, buf, w))
+      return 0;
+    *pos += w;
+  }
+  return 1;
+}
+
+unsigned long med_calls(void)
+{
+  return medcalls;
+}
+
+int med_write(int out, int fd, off_t size)
+{
+  off_t pos = 0;
+  unsigned i;
+
+  medcalls = 0;
+  qsort(edits, nedits, sizeof *edits, med_cmp);
+  for(i = 0; i < nedits; i++) {
+    const struct medit *e = &edits[i];
+    off_t at = e->off < size ? e->off : size;
+
+    if(at > pos && !copy_range(out, fd, &pos, at)) return 0;
+    if(!e->len) {
+      if(!write_all(out, medtext.s + e->text, e->tlen)) return 0;
+    }
+    else if(e->off + e->len > pos)
+      pos = e->off + e->len > size ? size : e->off + e->len;
+  }
+  return copy_range(out, fd, &pos, size);
+}
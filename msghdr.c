@@ -0,0 +1,294 @@
+/*
+ * Header index for the spooled message
+ * Separate module so every plugin shares one copy per process
+ *
+ * The first plugin to ask at message_end reads the header of the spool
+ * file and indexes it, and the rest use the index rather than each
+ * reading the file again from the top.  Only the header is read, the
+ * body is never looked at.
+ *
+ * mh_parse(int fd) -> 1 with the index built, or already built for this
+ *  file, 0 for error
+ * mh_count() -> number of header fields
+ * mh_end() -> offset of the blank line after the header, where new fields
+ *  go; the size of the file if there's no blank line
+ * mh_body() -> offset of the body, after the blank line
+ * mh_find(const char *name, int prev) -> index of the next field called
+ *  name (no colon, any case) after field prev, -1 to start; -1 for none
+ * mh_prefix(const char *prefix, int prev) -> same for names starting
+ *  with prefix
+ * mh_field(int i, off_t *off, unsigned long *len) -> text of field i,
+ *  continuation lines and LFs included, at off in the file
+ * mh_merge(const char *hdr, unsigned long len) -> 1 with edits in the
+ *  msgedit journal that make our header into hdr, 0 for out of memory;
+ *  fields hdr has word for word are left alone, so other plugins' edits
+ *  to them stand, ours it lacks are deleted and its new ones go in at
+ *  mh_end()
+ * mh_reset() forget it, for the next message
+ *
+ * The body offset is also left in session number "bodystart".
+ * Fields are numbered in the order they appear, so all of them in order
+ * are the bytes of the file up to mh_end().
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "mailfront.h"
+#include <str/str.h>
+
+extern int med_insert(off_t off, const char *text, unsigned long len);
+extern int med_delete(off_t off, off_t len);
+
+#define MHBUCKETS 64
+#define MHREAD 8192
+
+struct mhfield {
+  off_t off;
+  unsigned long len;
+  unsigned namelen;		/* 0 if it doesn't look like a field */
+  unsigned hash;
+  int next;			/* next with the same hash */
+};
+
+static struct mhfield *fields;
+static int nfields;
+static int maxfields;
+static int heads[MHBUCKETS];
+static int tails[MHBUCKETS];
+static str mhtext;		/* the header, and a little of the body */
+static off_t mhend;
+static off_t mhbody;
+static int mhbuilt;
+static struct stat mhst;	/* the file it's for */
+
+static unsigned mh_hash(const char *s, unsigned len)
+{
+  unsigned h = 2166136261U;
+
+  while(len-- > 0) {
+    unsigned char c = *s++;
+
+    if(c >= 'A' && c <= 'Z') c += 'a' - 'A';
+    h = (h ^ c) * 16777619U;
+  }
+  return h;
+}
+
+void mh_reset(void)
+{
+  int i;
+
+  mhbuilt = 0;
+  nfields = 0;
+  for(i = 0; i < MHBUCKETS; i++) heads[i] = tails[i] = -1;
+  str_truncate(&mhtext, 0);
+}
+
+static int mh_add(off_t off)
+{
+  struct mhfield *f;
+
+  if(nfields == maxfields) {
+    int n = maxfields ? 2 * maxfields : 64;
+    struct mhfield *nf = realloc(fields, n * sizeof *nf);
+
+    if(!nf) return 0;
+    fields = nf;
+    maxfields = n;
+  }
+  f = &fields[nfields++];
+  f->off = off;
+  f->len = 0;
+  f->namelen = 0;
+  f->hash = 0;
+  f->next = -1;
+  return 1;
+}
+
+/* name up to the colon, less any space before it */
+static void mh_name(int i)
+{
+  struct mhfield *f = &fields[i];
+  const char *s = mhtext.s + f->off;
+  const char *colon = memchr(s, ':', f->len);
+  unsigned n;
+  int b;
+
+  if(!colon) return;
+  for(n = colon - s; n > 0 && (s[n-1] == ' ' || s[n-1] == '\t'); n--)
+    ;
+  if(!n) return;
+  f->namelen = n;
+  f->hash = mh_hash(s, n);
+  b = f->hash % MHBUCKETS;
+  if(tails[b] >= 0) fields[tails[b]].next = i;
+  else heads[b] = i;
+  tails[b] = i;
+}
+
+/* read more of the file, 0 at EOF or error */
+static int mh_more(int fd)
+{
+  ssize_t r;
+
+  if(!str_ready(&mhtext, mhtext.len + MHREAD)) return 0;
+  do
+    r = pread(fd, mhtext.s + mhtext.len, MHREAD, mhtext.len);
+  while(r < 0 && errno == EINTR);
+  if(r <= 0) return 0;
+  mhtext.len += r;
+  return 1;
+}
+
+int mh_parse(int fd)
+{
+  struct stat st;
+  unsigned long pos = 0;
+  const char *nl;
+
+  if(fstat(fd, &st) != 0) return 0;
+  if(mhbuilt && st.st_ino == mhst.st_ino && st.st_dev == mhst.st_dev
+     && st.st_size == mhst.st_size)
+    return 1;
+  mh_reset();
+
+  for(;;) {
+    /* a whole line */
+    while((nl = pos < mhtext.len ? memchr(mhtext.s + pos, LF, mhtext.len - pos) : 0) == 0)
+      if(!mh_more(fd)) break;
+    if(!nl) {			/* no blank line, it's all header */
+      if(pos < mhtext.len) {
+	if(!mh_add(pos)) return 0;
+	fields[nfields-1].len = mhtext.len - pos;
+	mh_name(nfields-1);
+      }
+      mhend = mhbody = mhtext.len;
+      break;
+    }
+    if(nl == mhtext.s + pos
+       || (nl == mhtext.s + pos + 1 && mhtext.s[pos] == '\r')) {
+      mhend = pos;
+      mhbody = nl + 1 - mhtext.s;
+      break;
+    }
+    if((mhtext.s[pos] == ' ' || mhtext.s[pos] == '\t') && nfields > 0)
+      fields[nfields-1].len += nl + 1 - (mhtext.s + pos);
+    else {
+      if(!mh_add(pos)) return 0;
+      fields[nfields-1].len = nl + 1 - (mhtext.s + pos);
+      mh_name(nfields-1);	/* from the first line */
+    }
+    pos = nl + 1 - mhtext.s;
+  }
+
+  mhst = st;
+  mhbuilt = 1;
+  session_setnum("bodystart", mhbody);
+  return 1;
+}
+
+int mh_count(void)
+{
+  return nfields;
+}
+
+off_t mh_end(void)
+{
+  return mhend;
+}
+
+off_t mh_body(void)
+{
+  return mhbody;
+}
+
+int mh_find(const char *name, int prev)
+{
+  unsigned n = strlen(name);
+  unsigned h = mh_hash(name, n);
+  int i;
+
+  if(!mhbuilt) return -1;
+  for(i = prev < 0 ? heads[h % MHBUCKETS] : fields[prev].next; i >= 0; i = fields[i].next)
+    if(fields[i].hash == h && fields[i].namelen == n
+       && !strncasecmp(mhtext.s + fields[i].off, name, n))
+      return i;
+  return -1;
+}
+
+int mh_prefix(const char *prefix, int prev)
+{
+  unsigned n = strlen(prefix);
+  int i;
+
+  if(!mhbuilt) return -1;
+  for(i = prev + 1; i < nfields; i++)
+    if(fields[i].namelen >= n
+       && !strncasecmp(mhtext.s + fields[i].off, prefix, n))
+      return i;
+  return -1;
+}
+
+const char* mh_field(int i, off_t *off, unsigned long *len)
+{
+  if(off) *off = fields[i].off;
+  if(len) *len = fields[i].len;
+  return mhtext.s + fields[i].off;
+}
+
+int mh_merge(const char *hdr, unsigned long len)
+{
+  static char *seen;
+  static int maxseen;
+  static str name;
+  const char *f, *nl, *colon, *end = hdr + len;
+  unsigned long flen, tlen;
+  off_t off;
+  int i;
+
+  if(!mhbuilt) return 0;
+  if(nfields > maxseen) {
+    char *s = realloc(seen, nfields);
+
+    if(!s) return 0;
+    seen = s;
+    maxseen = nfields;
+  }
+  if(nfields) memset(seen, 0, nfields);
+
+  for(f = hdr; f < end && *f != LF; f += flen) {
+    /* the field and its continuation lines */
+    flen = 0;
+    do {
+      nl = memchr(f + flen, LF, end - f - flen);
+      flen = nl ? (unsigned long)(nl + 1 - f) : (unsigned long)(end - f);
+    } while(f + flen < end && (f[flen] == ' ' || f[flen] == '\t'));
+
+    if((colon = memchr(f, ':', flen)) != 0) {
+      while(colon > f && (colon[-1] == ' ' || colon[-1] == '\t')) colon--;
+      if(!str_copyb(&name, f, colon - f)) return 0;
+      for(i = mh_find(name.s, -1); i >= 0; i = mh_find(name.s, i))
+	if(!seen[i] && fields[i].len == flen
+	   && !memcmp(mhtext.s + fields[i].off, f, flen)) break;
+    } else {
+      for(i = 0; i < nfields; i++)
+	if(!seen[i] && fields[i].len == flen
+	   && !memcmp(mhtext.s + fields[i].off, f, flen)) break;
+      if(i == nfields) i = -1;
+    }
+    if(i >= 0) seen[i] = 1;
+    else if(!med_insert(mhend, f, flen)) return 0;
+  }
+
+  for(i = 0; i < nfields; i++) {
+    if(seen[i]) continue;
+    mh_field(i, &off, &tlen);
+    if(!med_delete(off, tlen)) return 0;
+  }
+  return 1;
+}
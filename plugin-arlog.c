@@ -3,13 +3,31 @@
  * authserv-id in A-R header is env AUTHSERVID,
  * defaulting to TCPLOCALHOST
  * and log it in a SQL database
- * Check DKIM signatures if any
- * Check SPF, too
+ * Check DKIM signatures if any, fed to opendkim as the message comes in
+ * with the keys looked up in parallel as soon as the header is in
+ * and outcomes remembered across processes for repeats of the same message
+ * Check SPF, too, in a thread started at MAIL FROM
+ * SPF results are shared by all processes for env SPFCACHETTL seconds
+ * (default 300, 0 for none), keyed by client IP, sender domain and HELO
+ * domains listed in control/spfcompile have their SPF records compiled
+ * into prefix tries by spfcomp.so, and checked without libspf2
  * env DMARCREJECT=y means actually do reject
  * env DMARCRUF means @virtdom for DMARC failure reports
+ * env RUFSPOOL is a directory where failures are noted for rufsend,
+ * which sends them as AFRF reports to the ruf addresses, with the
+ * From, To, Subject, Date and Message-ID fields of the message
  * file control/nodmarcpolicy lists domains not to reject
+ * if pslcomp has made control/effective_tld_names.psl when the first
+ * message comes in, DMARC records and organizational domains come from
+ * the shared trie in psl.so rather than from libopendmarc's private copy
+ * and the From: domain's DMARC record is looked up while the body comes in
  * note that reject just sets a flag, needs code in backend-qmailsump
  * to do the rejection after maybe queueing for failure report
+ * the new A-R header, and dropping any old ones of ours found in
+ * msghdr's index, go in the msgedit journal, the spool file isn't copied
+ * Needs backend-qmailsump or backend-spool, which apply the journal;
+ * with any other backend the message is refused rather than sent on
+ * without the edits
  *
  * Needs to run with sqlog to assign sqlseq
  *******************************
@@ -44,20 +62,27 @@ CREATE TABLE maildmarc (
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
 #include <sys/time.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
 #include <string.h>
 #include "mailfront.h"
 #include "conf_qmail.c"
-#include <iobuf/ibuf.h>
-#include <iobuf/obuf.h>
 #include <msg/msg.h>
 /* HACK HACK */
 #undef CLOCK_REALTIME
 #undef CLOCK_MONOTONIC
-#include <dict/dict.h>
-#include <dict/load.h>
 
 #include <opendkim/dkim.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
 
 /* way too much junk for SPF */
 # include <sys/socket.h>   /* inet_ functions / structs */
@@ -71,54 +96,561 @@ extern int opendb(void);
 extern int newsqlmsg(void);
 extern int sqlquote(str *in, str *out);
 extern int sqlquery(str *query, unsigned int *seqno);
+extern int ctl_lookup(const char *file, str *key);
+extern int psl_available(void);
+extern const char* psl_align(const char *dom, const char *fromdom, int strict);
+extern int psl_dmarc_record(const char *domain, str *rec, str *recdom);
+extern int shm_open_table(const char *name, unsigned nslots, unsigned vsize);
+extern int shm_fetch(int t, const char *key, unsigned klen, void *val);
+extern int shm_store(int t, const char *key, unsigned klen, const void *val, unsigned ttl);
+extern int spfc_lookup(const char *domain, const char *ip, int *qual);
+extern int spfc_compile(const char *domain);
+extern int med_insert(off_t off, const char *text, unsigned long len);
+extern int med_delete(off_t off, off_t len);
+extern int med_check(void);
+extern int mh_parse(int fd);
+extern int mh_find(const char *name, int prev);
+extern const char* mh_field(int i, off_t *off, unsigned long *len);
+extern int ar_str(int a, str *out, const char *s, unsigned long len);
+extern void ar_reset(int a);
+#define AR_MSG 0
 
 static str arstr = { 0,0,0};		/* authentication results header */
+static str rufpath;
 
 static str spf_sresponse = {0,0,0 };	/* save for sql later */
 
 static int spf_result;					/* for DMARC */
 static str spf_domain = { 0,0,0 };		/* for DMARC */
 
-static RESPONSE(no_chdir,451,"4.3.0 Could not change to the qmail directory.");
 static RESPONSE(nodmarc,550,"5.7.1 DMARC policy failure");
 
-static dict dmnp;
+/* library contexts, set up once per process so their caches last */
+static DKIM_LIB *dkimlib;
+static SPF_server_t *spf_server;
+static OPENDMARC_LIB_T dmarclib = {
+	.tld_type = OPENDMARC_TLD_TYPE_MOZILLA
+};
+static int dmarcinit;
+static int usepsl;			/* psl.so does org domains */
 
-static const response* arlog_sender(str* sender, str* params)
+/* DKIM verification as the message comes in */
+#define DKCHUNK 65536
+static DKIM *dk;
+static int dkstop;			/* opendkim doesn't want any more */
+static str dkbuf;			/* batched up for dkim_chunk */
+static str dkline;			/* header line being collected */
+static int dkinbody;
+static str armatch;			/* our own A-R header */
+
+/*
+ * DKIM keys are fetched on their own threads as soon as the header is
+ * in, and opendkim's key lookup callback waits for the answer
+ */
+#define MAXDKFETCH 8
+static struct dkfetch {
+	pthread_t tid;
+	int running;
+	str name;			/* selector._domainkey.domain */
+	str key;
+	int status;			/* 1 found, 0 none, -1 DNS trouble */
+	unsigned ttl;
+} dkfetch[MAXDKFETCH], dknow;
+static int ndkfetch;
+
+static void *dk_fetchkey(void *arg)
+{
+	struct dkfetch *f = arg;
+	unsigned char ans[4096];
+	ns_msg msg;
+	ns_rr rr;
+	int len, i;
+
+	f->status = -1;
+	len = res_query(f->name.s, C_IN, T_TXT, ans, sizeof ans);
+	if(len < 0) {
+		if(h_errno == HOST_NOT_FOUND || h_errno == NO_DATA) f->status = 0;
+		return 0;
+	}
+	if(ns_initparse(ans, len, &msg) < 0) return 0;
+	for(i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+		const unsigned char *p, *e;
+
+		if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) return 0;
+		if(ns_rr_type(rr) != ns_t_txt) continue;
+		/* glue the strings together */
+		str_truncate(&f->key, 0);
+		for(p = ns_rr_rdata(rr), e = p + ns_rr_rdlen(rr); p < e; p += 1 + *p) {
+			if(p + 1 + *p > e) break;
+			if(!str_catb(&f->key, (const char *)p+1, *p)) return 0;
+		}
+		f->status = 1;
+		f->ttl = ns_rr_ttl(rr);
+		return 0;
+	}
+	f->status = 0;
+	return 0;
+}
+
+static int dk_keyname(str *name, DKIM_SIGINFO *sig)
+{
+	const char *sel = (const char *)dkim_sig_getselector(sig);
+	const char *d = (const char *)dkim_sig_getdomain(sig);
+
+	if(!sel || !d) return 0;
+	return str_copy3s(name, sel, "._domainkey.", d);
+}
+
+/*
+ * Verification memo: byte-identical signed messages come in again and
+ * again from lists and ESPs, so outcomes are kept in a shared table
+ * keyed by d=, s= and b=, with a SHA-256 of everything opendkim saw.
+ * A repeat skips the key fetch and the RSA, for env DKMEMOTTL seconds
+ * (default 3600, 0 for none) or the key's DNS TTL if that's shorter.
+ */
+#define DKMEMO_PASS 1
+#define DKMEMO_BADBODY 2
+#define DKMEMO_BADSIG 3
+#define MAXDKMEMO 16
+struct dkmemo {
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	int outcome;
+};
+static int dkmemotab = -2;
+static unsigned dkmemottl;
+static EVP_MD_CTX *dksha;
+static unsigned char dkdigest[SHA256_DIGEST_LENGTH];
+static int dkmemohit[MAXDKMEMO];	/* outcome by signature, 0 if none */
+
+static int dk_memokey(str *key, DKIM_SIGINFO *sig)
+{
+	const char *d = (const char *)dkim_sig_getdomain(sig);
+	const char *s = (const char *)dkim_sig_getselector(sig);
+	const char *b = (const char *)dkim_sig_gettagvalue(sig, 0, (u_char *)"b");
+
+	if(dkmemotab == -2) {
+		const char *e = getenv("DKMEMOTTL");
+
+		dkmemottl = e? strtoul(e, 0, 10): 3600;
+		dkmemotab = dkmemottl? shm_open_table("dkimmemo", 8192, sizeof(struct dkmemo)): -1;
+	}
+	if(dkmemotab < 0 || !d || !s || !b) return 0;
+	return str_copyb(key, d, strlen(d)+1)
+		&& str_catb(key, s, strlen(s)+1)
+		&& str_cats(key, b);
+}
+
+/* seen this signature before? digest 0 for any message */
+static int dk_memofetch(DKIM_SIGINFO *sig, const unsigned char *digest)
+{
+	static str key;
+	struct dkmemo m;
+
+	if(!dk_memokey(&key, sig) || !shm_fetch(dkmemotab, key.s, key.len, &m))
+		return 0;
+	if(digest && memcmp(digest, m.digest, sizeof m.digest)) return 0;
+	return m.outcome;
+}
+
+/* before dkim_eom, so signatures we know about are ignored */
+static void dk_memocheck(void)
+{
+	DKIM_SIGINFO **sigs;
+	int nsigs, i;
+
+	memset(dkmemohit, 0, sizeof dkmemohit);
+	if(!EVP_DigestFinal_ex(dksha, dkdigest, 0)) return;
+	if(dkim_getsiglist(dk, &sigs, &nsigs) != DKIM_STAT_OK) return;
+	for(i = 0; i < nsigs && i < MAXDKMEMO; i++)
+		if((dkmemohit[i] = dk_memofetch(sigs[i], dkdigest)) != 0)
+			dkim_sig_ignore(sigs[i]);
+}
+
+/* outcome of signature i, from the memo or opendkim, 0 if neither */
+static int dk_outcome(DKIM_SIGINFO *sig, int i)
+{
+	static str key;
+	struct dkmemo m;
+	unsigned ttl = dkmemottl;
+	int j;
+
+	if(i < MAXDKMEMO && dkmemohit[i]) return dkmemohit[i];
+	if(dkim_sig_process(dk, sig) != DKIM_STAT_OK) return 0;
+	if(!(dkim_sig_getflags(sig) & DKIM_SIGFLAG_PASSED))
+		m.outcome = DKMEMO_BADSIG;
+	else if(dkim_sig_getbh(sig) == DKIM_SIGBH_MATCH)
+		m.outcome = DKMEMO_PASS;
+	else
+		m.outcome = DKMEMO_BADBODY;
+
+	if(dk_memokey(&key, sig)) {
+		/* no longer than the key might be cached */
+		if(dk_keyname(&dknow.name, sig)) {
+			for(j = 0; j < ndkfetch; j++)
+				if(!str_diff(&dkfetch[j].name, &dknow.name)) break;
+			if(j < ndkfetch && dkfetch[j].status > 0 && dkfetch[j].ttl < ttl)
+				ttl = dkfetch[j].ttl;
+		}
+		if(ttl) {
+			memcpy(m.digest, dkdigest, sizeof m.digest);
+			shm_store(dkmemotab, key.s, key.len, &m, ttl);
+		}
+	}
+	return m.outcome;
+}
+
+/* header's all in, start looking up every signature's key */
+static void dk_prefetch(void)
+{
+	DKIM_SIGINFO **sigs;
+	int nsigs, i, j;
+
+	if(dkim_getsiglist(dk, &sigs, &nsigs) != DKIM_STAT_OK) return;
+	for(i = 0; i < nsigs && ndkfetch < MAXDKFETCH; i++) {
+		struct dkfetch *f = &dkfetch[ndkfetch];
+
+		if(!dk_keyname(&f->name, sigs[i])) continue;
+		for(j = 0; j < ndkfetch; j++)
+			if(!str_diff(&dkfetch[j].name, &f->name)) break;
+		if(j < ndkfetch) continue;	/* same key twice */
+		if(dk_memofetch(sigs[i], 0)) continue;	/* probably won't need it */
+		if(pthread_create(&f->tid, NULL, dk_fetchkey, f) != 0) break;
+		f->running = 1;
+		ndkfetch++;
+	}
+}
+
+static void dk_unfetch(void)
+{
+	int i;
+
+	for(i = 0; i < ndkfetch; i++)
+		if(dkfetch[i].running) {
+			pthread_join(dkfetch[i].tid, NULL);
+			dkfetch[i].running = 0;
+		}
+	ndkfetch = 0;
+}
+
+/* opendkim's key lookup, from the prefetch if there is one */
+static DKIM_CBSTAT dk_keylookup(DKIM *dkim, DKIM_SIGINFO *sig, u_char *buf, size_t buflen)
+{
+	struct dkfetch *f = &dknow;
+	int i;
+
+	if(!dk_keyname(&dknow.name, sig)) return DKIM_CBSTAT_NOTFOUND;
+	for(i = 0; i < ndkfetch; i++)
+		if(!str_diff(&dkfetch[i].name, &dknow.name)) {
+			f = &dkfetch[i];
+			if(f->running) {
+				pthread_join(f->tid, NULL);
+				f->running = 0;
+			}
+			break;
+		}
+	if(f == &dknow) dk_fetchkey(f);	/* not prefetched, ask now */
+
+	if(f->status < 0) return DKIM_CBSTAT_TRYAGAIN;
+	if(f->status == 0 || f->key.len >= buflen) return DKIM_CBSTAT_NOTFOUND;
+	memcpy(buf, f->key.s, f->key.len + 1);
+	return DKIM_CBSTAT_CONTINUE;
+	(void)dkim;
+}
+
+static DKIM_LIB *get_dkimlib(void)
+{
+	unsigned int opts = DKIM_LIBFLAGS_FIXCRLF;
+	DKIM_STAT ds;
+
+	if(dkimlib) return dkimlib;
+	dkimlib = dkim_init(NULL, NULL);
+	if(!dkimlib) {
+		msg1("dkim_init failed");
+		return 0;
+	}
+	ds = dkim_options(dkimlib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS, &opts, sizeof(opts));
+	if(ds != DKIM_STAT_OK) {
+		msg2("dkim_options failed: ", dkim_getresultstr(ds));
+		dkim_close(dkimlib);
+		dkimlib = 0;
+		return 0;
+	}
+	dkim_set_key_lookup(dkimlib, dk_keylookup);
+	return dkimlib;
+}
+
+/* parses the public suffix list, so only do it once */
+static int get_dmarclib(void)
+{
+	const char *qh;
+
+	if(dmarcinit) return 1;
+	if(psl_available()) {
+		usepsl = 1;
+		dmarclib.tld_type = OPENDMARC_TLD_TYPE_NONE;
+		if(opendmarc_policy_library_init(&dmarclib) != DMARC_PARSE_OKAY) {
+			msg1("opendmarc_policy_library_init failed");
+			return 0;
+		}
+		dmarcinit = 1;
+		return 1;
+	}
+	if ((qh = getenv("QMAILHOME")) == 0)
+		qh = conf_qmail;
+	if(strlen(qh) + sizeof "/control/effective_tld_names.dat" > sizeof dmarclib.tld_source_file)
+		return 0;
+	strcpy((char *)dmarclib.tld_source_file, qh);
+	strcat((char *)dmarclib.tld_source_file, "/control/effective_tld_names.dat");
+	if(opendmarc_policy_library_init(&dmarclib) != DMARC_PARSE_OKAY) {
+		msg1("opendmarc_policy_library_init failed");
+		return 0;
+	}
+	dmarcinit = 1;
+	return 1;
+}
+
+/*
+ * With psl.so doing DMARC lookups, the From: domain's record is looked
+ * up on a thread as soon as the From: header has gone by
+ */
+static struct {
+	pthread_t tid;
+	int running;
+	str domain;
+	str rec, recdom;
+	int found;
+} dmfetch;
+static str fromhdr;			/* From: being collected */
+static int infrom, sawfrom;
+
+static void *dm_fetchrec(void *arg)
+{
+	dmfetch.found = psl_dmarc_record(dmfetch.domain.s, &dmfetch.rec, &dmfetch.recdom);
+	return 0;
+	(void)arg;
+}
+
+static void dm_join(void)
+{
+	if(dmfetch.running) {
+		pthread_join(dmfetch.tid, NULL);
+		dmfetch.running = 0;
+	}
+}
+
+/* pick the domain out of the From: header and start the lookup */
+static void dm_prefetch(void)
+{
+	const char *s = fromhdr.s + 5;
+	const char *e = fromhdr.s + fromhdr.len;
+	const char *lt, *at;
+	unsigned n;
+
+	str_truncate(&dmfetch.domain, 0);
+	if(!get_dmarclib() || !usepsl) return;
+	if((lt = memchr(s, '<', e - s)) != 0) s = lt + 1;
+	for(at = 0; s < e && *s != '>'; s++)
+		if(*s == '@') at = s;
+	if(!at) return;
+	for(n = 0; at + 1 + n < s && !strchr(" \t\r\n,;)", at[1+n]); n++)
+		;
+	if(!n || !str_copyb(&dmfetch.domain, at + 1, n)) return;
+	if(pthread_create(&dmfetch.tid, NULL, dm_fetchrec, NULL) == 0)
+		dmfetch.running = 1;
+	else
+		str_truncate(&dmfetch.domain, 0);
+}
+
+/* record for the From: domain, prefetched if we guessed right */
+static int dm_record(const char *domain, str *rec, str *recdom)
+{
+	dm_join();
+	if(dmfetch.domain.len && !strcasecmp(dmfetch.domain.s, domain)) {
+		if(dmfetch.found > 0 && (!str_copy(rec, &dmfetch.rec) || !str_copy(recdom, &dmfetch.recdom)))
+			return -1;
+		return dmfetch.found;
+	}
+	return psl_dmarc_record(domain, rec, recdom);
+}
+
+/* SPF runs in its own thread from MAIL FROM until message_end needs it */
+static struct {
+	pthread_t tid;
+	int running;
+	str ip, helo, sender;
+	SPF_result_t result;		/* SPF_RESULT_INVALID for none */
+	int cached;			/* result came from spfcache or spfcomp */
+	int compile;			/* domain wants a fresh compiled trie */
+	str key;
+	str domain;
+} spfjob;
+
+static int spfcache = -2;
+static unsigned spfcachettl;
+
+/* ip NUL domain NUL helo, then look it up */
+static int spf_cached(void)
+{
+	const char *at;
+	int r;
+	unsigned i;
+
+	if(spfcache == -2) {
+		const char *e = getenv("SPFCACHETTL");
+
+		spfcachettl = e? strtoul(e, 0, 10): 300;
+		spfcache = spfcachettl? shm_open_table("spfcache", 8192, sizeof r): -1;
+	}
+	str_truncate(&spfjob.key, 0);
+	if(spfcache < 0) return 0;
+	at = strrchr(spfjob.sender.s, '@');
+	if(!str_copy(&spfjob.key, &spfjob.ip)
+	   || !str_catb(&spfjob.key, "", 1)
+	   || !str_cats(&spfjob.key, at? at+1: "")
+	   || !str_catb(&spfjob.key, "", 1)
+	   || !str_cat(&spfjob.key, &spfjob.helo)) {
+		str_truncate(&spfjob.key, 0);
+		return 0;
+	}
+	for(i = spfjob.ip.len; i < spfjob.key.len; i++)
+		if(spfjob.key.s[i] >= 'A' && spfjob.key.s[i] <= 'Z') spfjob.key.s[i] += 'a' - 'A';
+	if(!shm_fetch(spfcache, spfjob.key.s, spfjob.key.len, &r)) return 0;
+	spfjob.result = r;
+	return 1;
+}
+
+static SPF_result_t qual_result(int qual)
+{
+	switch(qual) {
+		case '+': return SPF_RESULT_PASS;
+		case '-': return SPF_RESULT_FAIL;
+		case '~': return SPF_RESULT_SOFTFAIL;
+		default: return SPF_RESULT_NEUTRAL;
+	}
+}
+
+/* sender domain's compiled trie, 1 decided, 0 not */
+static int spf_compiled(void)
+{
+	const char *at = strrchr(spfjob.sender.s, '@');
+	int qual;
+	int r;
+
+	str_truncate(&spfjob.domain, 0);
+	spfjob.compile = 0;
+	if(!at || !at[1]) return 0;	/* null sender, HELO check for libspf2 */
+	if(!str_copys(&spfjob.domain, at+1)) return 0;
+	str_lower(&spfjob.domain);
+
+	if((r = spfc_lookup(spfjob.domain.s, spfjob.ip.s, &qual)) == 1) {
+		spfjob.result = qual_result(qual);
+		return 1;
+	}
+	/* stale or never compiled, do it in the thread if it's wanted */
+	if(r < 0 && ctl_lookup("control/spfcompile", &spfjob.domain) > 0)
+		spfjob.compile = 1;
+	return 0;
+}
+
+static void *spf_thread(void *arg)
 {
-	SPF_server_t *spf_server;
 	SPF_request_t *spf_request;
-	SPF_response_t *spf_response;
-	const char *ip;
-	const char *helo = session_getstr("helo_domain");
-	
-	ip = getprotoenv("REMOTEIP");
-	if(!ip) return 0;		/* can't tell IP, no SPF */
+	SPF_response_t *spf_response = 0;
+
+	if(spfjob.compile && spfc_compile(spfjob.domain.s) > 0) {
+		int qual;
+
+		if(spfc_lookup(spfjob.domain.s, spfjob.ip.s, &qual) == 1) {
+			spfjob.result = qual_result(qual);
+			return 0;
+		}
+	}
 
-	spf_server = SPF_server_new(SPF_DNS_CACHE, 0);
-	if(!spf_server) return 0;
 	spf_request = SPF_request_new(spf_server);
+	if(!spf_request) return 0;
 
-	if(strchr(ip, ':'))
-	   SPF_request_set_ipv6_str( spf_request, ip);
+	if(strchr(spfjob.ip.s, ':'))
+	   SPF_request_set_ipv6_str( spf_request, spfjob.ip.s);
 	else
-		SPF_request_set_ipv4_str( spf_request, ip );
+		SPF_request_set_ipv4_str( spf_request, spfjob.ip.s );
 
-	SPF_request_set_helo_dom( spf_request, helo);
-	SPF_request_set_env_from( spf_request, sender->s);
+	SPF_request_set_helo_dom( spf_request, spfjob.helo.len? spfjob.helo.s: NULL);
+	SPF_request_set_env_from( spf_request, spfjob.sender.s);
 
 	SPF_request_query_mailfrom(spf_request, &spf_response);
-	str_init(&spf_sresponse);
-	str_copys(&spf_sresponse, SPF_strresult(SPF_response_result(spf_response)));
+	if(spf_response) {
+		spfjob.result = SPF_response_result(spf_response);
+		SPF_response_free(spf_response);
+	}
+	SPF_request_free(spf_request);
+	return 0;
+	(void)arg;
+}
+
+static void spf_join(void)
+{
+	if(spfjob.running) {
+		pthread_join(spfjob.tid, NULL);
+		spfjob.running = 0;
+	}
+}
+
+static const response* arlog_sender(str* sender, str* params)
+{
+	const char *ip;
+	const char *helo = session_getstr("helo_domain");
+
+	spf_join();		/* earlier transaction's, not wanted now */
+	spfjob.result = SPF_RESULT_INVALID;
+
+	ip = getprotoenv("REMOTEIP");
+	if(!ip) return 0;		/* can't tell IP, no SPF */
+
+	if(!spf_server) spf_server = SPF_server_new(SPF_DNS_CACHE, 0);
+	if(!spf_server) return 0;
+
+	if(!str_copys(&spfjob.ip, ip)
+	   || !str_copys(&spfjob.helo, helo? helo: "")
+	   || !str_copy(&spfjob.sender, sender)) return &resp_oom;
 
-	if(!arstr.s) str_init(&arstr);
-	str_cat2s(&arstr, "; spf=", spf_sresponse.s);
-	str_cat4s(&arstr, " spf.mailfrom=", sender->s, " spf.helo=", helo);
-	
 	/* for DMARC later */
 	if(!spf_domain.s) str_init(&spf_domain);
 	str_copys(&spf_domain, sender->s);
-	switch (SPF_response_result(spf_response)) {
+
+	if((spfjob.cached = spf_cached() || spf_compiled()) != 0)
+		return 0;		/* seen it lately, no need to ask */
+	if(pthread_create(&spfjob.tid, NULL, spf_thread, NULL) == 0)
+		spfjob.running = 1;
+	else
+		spf_thread(NULL);	/* do it the slow way */
+
+	return 0;
+	(void)params;
+}
+
+/* wait for SPF and start the A-R header with it */
+static void spf_finish(void)
+{
+	const char *res;
+
+	spf_join();
+	str_truncate(&arstr, 0);
+	str_truncate(&spf_sresponse, 0);
+	spf_result = DMARC_POLICY_SPF_OUTCOME_NONE;
+	if(spfjob.result == SPF_RESULT_INVALID) return;
+	/* temporary trouble isn't worth remembering */
+	if(!spfjob.cached && spfjob.key.len && spfjob.result != SPF_RESULT_TEMPERROR) {
+		int r = spfjob.result;
+
+		shm_store(spfcache, spfjob.key.s, spfjob.key.len, &r, spfcachettl);
+	}
+
+	res = SPF_strresult(spfjob.result);
+	str_copys(&spf_sresponse, res);
+	str_cat2s(&arstr, "; spf=", res);
+	str_cat4s(&arstr, " spf.mailfrom=", spfjob.sender.s, " spf.helo=", spfjob.helo.s);
+
+	switch (spfjob.result) {
 		default: spf_result = DMARC_POLICY_SPF_OUTCOME_NONE; break;
 		case SPF_RESULT_PASS: spf_result = DMARC_POLICY_SPF_OUTCOME_PASS; break;
 		case SPF_RESULT_PERMERROR: 
@@ -127,36 +659,190 @@ static const response* arlog_sender(str* sender, str* params)
 		case SPF_RESULT_FAIL: spf_result = DMARC_POLICY_SPF_OUTCOME_FAIL; break;
 		case SPF_RESULT_TEMPERROR: spf_result = DMARC_POLICY_SPF_OUTCOME_TMPFAIL; break;
 	}
+}
 
-	SPF_response_free(spf_response);
-	SPF_request_free(spf_request);
-	SPF_server_free(spf_server);
+static void dk_flush(void)
+{
+	DKIM_STAT ds;
 
+	if(dk && !dkstop && dkbuf.len) {
+		EVP_DigestUpdate(dksha, dkbuf.s, dkbuf.len);
+		ds = dkim_chunk(dk, (unsigned char *)dkbuf.s, dkbuf.len);
+		if(ds != DKIM_STAT_OK) {
+			if(ds != DKIM_STAT_NOSIG)
+				msg2("dkim_chunk failed: ", dkim_getresultstr(ds));
+			dkstop = 1;
+		}
+	}
+	str_truncate(&dkbuf, 0);
+}
+
+static const response* arlog_data_start(int fd)
+{
+	const char *authservid = getenv("AUTHSERVID");
+	DKIM_LIB *dl;
+	DKIM_STAT ds;
+
+	if(!authservid) authservid = getprotoenv("LOCALHOST");
+	if(!authservid) authservid = "localhost";
+	str_copy3s(&armatch, "Authentication-Results:*",authservid,"*"); /* close enough */
+
+	if(dk) dkim_free(dk);
+	dk = 0;
+	dk_unfetch();
+	dm_join();
+	str_truncate(&dmfetch.domain, 0);
+	dkstop = dkinbody = infrom = sawfrom = 0;
+	if(!dksha && (dksha = EVP_MD_CTX_new()) == 0) return &resp_oom;
+	EVP_DigestInit_ex(dksha, EVP_sha256(), 0);
+	str_truncate(&dkbuf, 0);
+	str_truncate(&dkline, 0);
+	if((dl = get_dkimlib()) == 0) return 0;
+	dk = dkim_verify(dl, (unsigned char *)"msg", NULL, &ds);
+	if(!dk) msg2("dkim_verify failed: ", dkim_getresultstr(ds));
 	return 0;
-	(void)params;
+	(void)fd;
 }
 
-/* now run it through opendkim and opendmarc, and recopy with a-r header to a new file */
+static const response* arlog_data_block(const char* bytes, unsigned long len)
+{
+	const char *nl;
+	unsigned long n;
+	int wasinbody = dkinbody;
+
+	/* header a line at a time, to drop our own A-R */
+	while(len > 0 && !dkinbody) {
+		nl = memchr(bytes, LF, len);
+		n = nl? (unsigned long)(nl - bytes) + 1: len;
+		if(!str_catb(&dkline, bytes, n)) return &resp_oom;
+		bytes += n;
+		len -= n;
+		if(!nl) break;
+		if(infrom && (dkline.s[0] == ' ' || dkline.s[0] == '\t')) {
+			if(!str_cat(&fromhdr, &dkline)) return &resp_oom;
+		}
+		else {
+			if(infrom) {
+				infrom = 0;
+				dm_prefetch();
+			}
+			if(!sawfrom && str_case_starts(&dkline, "From:")) {
+				infrom = sawfrom = 1;
+				if(!str_copy(&fromhdr, &dkline)) return &resp_oom;
+			}
+		}
+		if(dkline.s[0] == LF || (dkline.s[0] == '\r' && dkline.len == 2))
+			dkinbody = 1;
+		if(!str_case_match(&dkline, &armatch)
+		   && dk && !dkstop && !str_cat(&dkbuf, &dkline))
+			return &resp_oom;
+		str_truncate(&dkline, 0);
+	}
+	if(dkinbody && !wasinbody) {
+		dk_flush();		/* opendkim sees the end of the header */
+		if(dk && !dkstop) dk_prefetch();
+	}
+	if(!dk || dkstop) return 0;
+
+	/* body in big chunks */
+	if(len > 0 && !str_catb(&dkbuf, bytes, len)) return &resp_oom;
+	if(dkbuf.len >= DKCHUNK) dk_flush();
+	return 0;
+}
+
+/* field for rufsend, no tabs or newlines */
+static int ruf_fieldb(str *line, const char *s, unsigned long len, char sep)
+{
+	for(; len > 0; s++, len--)
+		if(!str_catc(line, (*s == '\t' || *s == '\n' || *s == '\r')? ' ': *s)) return 0;
+	return str_catc(line, sep);
+}
+
+static int ruf_field(str *line, const char *s, char sep)
+{
+	return ruf_fieldb(line, s, strlen(s), sep);
+}
+
+/* header fields that go in the report, the rest are left out */
+static const char *rufhdrs[] = { "From", "To", "Subject", "Date", "Message-ID", 0 };
+
+/* note a failure in RUFSPOOL/pending, one write so lines don't mix */
+static void ruf_record(int msgfd, const char *ruf, const char *fromdom, const char *ip,
+		       const char *authservid)
+{
+	static str line;
+	const char *dir = getenv("RUFSPOOL");
+	const char *f;
+	unsigned long len;
+	off_t off;
+	struct stat fst, pst;
+	int fd, i, h;
+
+	if(!dir) return;
+	if(!str_copys(&line, "")
+	   || !str_catu(&line, time(0)) || !str_catc(&line, '\t')
+	   || !ruf_field(&line, ruf, '\t')
+	   || !ruf_field(&line, fromdom, '\t')
+	   || !ruf_field(&line, ip? ip: "unknown", '\t')
+	   || !ruf_field(&line, spfjob.sender.s? spfjob.sender.s: "", '\t')
+	   || !str_cat2s(&line, authservid, arstr.len? "": "; none")
+	   || !ruf_fieldb(&line, arstr.s, arstr.len, '\t')) return;
+
+	/* then a few of the message's header fields, unfolded */
+	for(i = 0; rufhdrs[i] && mh_parse(msgfd); i++) {
+		if((h = mh_find(rufhdrs[i], -1)) < 0
+		   || (f = mh_field(h, &off, &len)) == 0) continue;
+		while(len > 0 && (f[len-1] == '\n' || f[len-1] == '\r')) len--;
+		if(!ruf_fieldb(&line, f, len, '\t')) return;
+	}
+	line.s[line.len-1] = '\n';
+
+	str_copy2s(&rufpath, dir, "/pending");
+	/* rufsend renames the file away, then takes an exclusive lock to
+	   wait out writers; once we have the lock it must still be pending */
+	for(i = 0; ; i++) {
+		if((fd = open(rufpath.s, O_WRONLY|O_APPEND|O_CREAT, 0600)) < 0) {
+			msg2("can't open ", rufpath.s);
+			return;
+		}
+		if(flock(fd, LOCK_SH) != 0 || fstat(fd, &fst) != 0) break;
+		if(stat(rufpath.s, &pst) == 0 && pst.st_ino == fst.st_ino
+		   && pst.st_dev == fst.st_dev) {
+			if(write(fd, line.s, line.len) == (ssize_t)line.len) {
+				close(fd);
+				return;
+			}
+			break;
+		}
+		close(fd);
+		if(i == 5) {
+			msg2("can't catch ", rufpath.s);
+			return;
+		}
+	}
+	msg2("can't write ", rufpath.s);
+	close(fd);
+}
+
+/* now finish opendkim and run opendmarc, and note the a-r header */
 /* and add the sql records */
 static const response* arlog_message_end(int fd)
 {
-	DKIM_LIB *dl;
-	DKIM *dk;
 	DKIM_STAT ds;
 	DKIM_SIGINFO **sigs;
-	unsigned int opts = DKIM_LIBFLAGS_FIXCRLF;
-	OPENDMARC_LIB_T dmarclib = {
-		.tld_type = OPENDMARC_TLD_TYPE_MOZILLA,
-		.tld_source_file = "control/effective_tld_names.dat"
-	};
 	DMARC_POLICY_T *dmp = 0;
 	OPENDMARC_STATUS_T dms;
+	static str dmarcrec, dmarcdom;	/* record we looked up */
+	int dmarcfound = 0;
+	int adkim = DMARC_RECORD_A_RELAXED;
+	int aspf = DMARC_RECORD_A_RELAXED;
+	const char *spfdom;
 
-	int newfd;
-	ibuf msgib;
-	obuf newob;
-	str msgstr, matchstr;
-	str sqlstr;
+	static str arhdr;
+	off_t off;
+	unsigned long len;
+	int i;
+	static str sqlstr;
 	int sump = session_getnum("sump", 0);
 	int nsigs;
 	int doreject = 0;	/* DMARC results */
@@ -173,48 +859,20 @@ static const response* arlog_message_end(int fd)
 	if(!authservid) authservid = getprotoenv("LOCALHOST");
 	if(!authservid) authservid = "localhost";
 
-	dl = dkim_init(NULL, NULL);
-	if(!dl) {
-		msg1("dkim_init failed");
-		return 0;
-	}
-	ds = dkim_options(dl, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS, &opts, sizeof(opts));
-	if(ds != DKIM_STAT_OK) {
-		msg2("dkim_options failed: ", dkim_getresultstr(ds));
-		return 0;
-	}
-
-	dk = dkim_verify(dl, (unsigned char *)"msg", NULL, &ds);
-	if(!dk) {
-		msg2("dkim_verify failed: ", dkim_getresultstr(ds));
-		return 0;
-	}
+	spf_finish();
+	if(!dk) return 0;
 
-	/* can't use ibuf_rewind, it thinks it's already there */
-	if (lseek(fd, 0, SEEK_SET) != 0) return &resp_internal;
-	ibuf_init(&msgib, fd, 0, 0, 0);
-
-	/* send the message as chunks */
-	str_init(&msgstr);
-	str_init(&matchstr);
-	str_copy3s(&matchstr, "Authentication-Results:*",authservid,"*"); /* close enough */
-	while(ibuf_getstr(&msgib, &msgstr, LF)) {
-		/* check for existing A-R header from us and delete it */
-		if(str_case_match(&msgstr, &matchstr)) continue;
-
-		ds = dkim_chunk(dk, (unsigned char *)msgstr.s, msgstr.len);
-		if(ds != DKIM_STAT_OK) {
-			if(ds != DKIM_STAT_NOSIG)
-				msg2("dkim_chunk failed: ", dkim_getresultstr(ds));
-			break;
-		}
-	}
+	/* the message has all been fed in by data_block, just finish up */
+	if(!dkinbody && !dkstop && dkline.len && !str_cat(&dkbuf, &dkline))
+		return &resp_oom;
+	dk_flush();
 	dkim_chunk(dk, NULL, 0);
+	dk_memocheck();
 	ds = dkim_eom(dk, NULL);
 
-	str_init(&fromdom);
 	qh = (char *)dkim_getdomain(dk);
-	if(qh)str_copys(&fromdom, qh);
+	if(!qh) qh = "";
+	if(!ar_str(AR_MSG, &fromdom, qh, strlen(qh))) return &resp_oom;
 
 	ds = dkim_getsiglist(dk, &sigs, &nsigs);
 	if(ds != DKIM_STAT_OK) {
@@ -225,11 +883,10 @@ static const response* arlog_message_end(int fd)
 	/* do the spf */
 	sqlseq = session_getnum("sqlseq", 0L); /* if set, mysql is
 						open and serial	assigned */
-	if(!str_init(&sqlstr)) return &resp_internal;
 	if(sqlseq > 0) {
 		if(!str_copys(&sqlstr, "INSERT INTO mailspf SET serial=")
 		   || !str_catu(&sqlstr, sqlseq)) return &resp_internal;
-		if(spf_sresponse.s)
+		if(spf_sresponse.len)
 			if(!str_cat3s(&sqlstr, ",result='",spf_sresponse.s,"'")) return &resp_internal;
 		if(helo)
 			if(!str_cat3s(&sqlstr, ",helo='",helo,"'")) return &resp_internal;
@@ -242,23 +899,35 @@ static const response* arlog_message_end(int fd)
 		msg2("no sqlseq ", fromdom.s);
 
 	/* check dmarc policy if there's anything to check */
+	if(fromdom.len && !get_dmarclib()) str_truncate(&fromdom, 0);
 	if(fromdom.len) {
-		if ((qh = getenv("QMAILHOME")) == 0)	/* for reference to public suffix file in control/ */
-			qh = conf_qmail;
-		if (chdir(qh) == -1) return &resp_no_chdir;
-
-		opendmarc_policy_library_init(&dmarclib);
 		dmp = opendmarc_policy_connect_init((u_char *)ip, !!strchr(ip, ':'));
 		if(!dmp) return &resp_internal;
 		if(opendmarc_policy_store_from_domain(dmp, (u_char *)fromdom.s) != DMARC_PARSE_OKAY) {
 			/* bogus from, should recover, but probably no great loss */
 			return &resp_internal;
 		}
-	
+		if(usepsl) {
+			/* our own lookup, with the org domain fallback */
+			dmarcfound = dm_record(fromdom.s, &dmarcrec, &dmarcdom);
+			if(dmarcfound > 0) {
+				opendmarc_policy_store_dmarc(dmp, (u_char *)dmarcrec.s,
+					(u_char *)fromdom.s, (u_char *)dmarcdom.s);
+				opendmarc_policy_fetch_adkim(dmp, &adkim);
+				opendmarc_policy_fetch_aspf(dmp, &aspf);
+			}
+		}
+
 		/* install SPF results here */
-		opendmarc_policy_store_spf(dmp, (u_char *)(spf_domain.len? spf_domain.s: helo), spf_result,
-							   spf_domain.len?DMARC_POLICY_SPF_ORIGIN_MAILFROM: DMARC_POLICY_SPF_ORIGIN_HELO,
-							   NULL);
+		spfdom = spf_domain.len? spf_domain.s: helo;
+		if(usepsl && spfdom) {
+			const char *at = strrchr(spfdom, '@');
+
+			spfdom = psl_align(at? at+1: spfdom, fromdom.s, aspf == DMARC_RECORD_A_STRICT);
+		}
+		opendmarc_policy_store_spf(dmp, (u_char *)spfdom, spf_result,
+				   spf_domain.len?DMARC_POLICY_SPF_ORIGIN_MAILFROM: DMARC_POLICY_SPF_ORIGIN_HELO,
+				   NULL);
 	}
 
 	if(nsigs > 0) {
@@ -268,10 +937,9 @@ static const response* arlog_message_end(int fd)
 
 		for(i = 0; i < nsigs; i++) {
 			DKIM_SIGINFO *sp = sigs[i];
-			DKIM_STAT dss = dkim_sig_process(dk, sp);
+			int outcome = dk_outcome(sp, i);
 
-			if(dss == DKIM_STAT_OK) {
-				unsigned int fl = dkim_sig_getflags(sp);
+			if(outcome) {
 				char hashbuf[20];
 				int dmx = DMARC_POLICY_DKIM_OUTCOME_NONE;
 				size_t hblen;
@@ -280,8 +948,8 @@ static const response* arlog_message_end(int fd)
 				if(!str_copys(&sqlstr, "INSERT INTO maildkim SET serial=")
 				   || !str_catu(&sqlstr, sqlseq)) return &resp_internal;
 
-				if(fl & DKIM_SIGFLAG_PASSED) {
-					if(dkim_sig_getbh(sp) == DKIM_SIGBH_MATCH) {
+				if(outcome != DKMEMO_BADSIG) {
+					if(outcome == DKMEMO_PASS) {
 						str_cats(&arstr, "; dkim=pass");
 						str_cats(&sqlstr, ",result='pass'");
 						dmx = DMARC_POLICY_DKIM_OUTCOME_PASS;
@@ -307,7 +975,10 @@ static const response* arlog_message_end(int fd)
 				if(ds == DKIM_STAT_OK) {
 					str_cat3s(&arstr, " header.b=\"", hashbuf, "\"");
 					str_cat3s(&sqlstr, ",sigstr='", hashbuf, "'");
-					if(fromdom.len)opendmarc_policy_store_dkim(dmp, (unsigned char *)d, dmx, NULL);
+					if(fromdom.len) {
+						if(usepsl) d = (char *)psl_align(d, fromdom.s, adkim == DMARC_RECORD_A_STRICT);
+						opendmarc_policy_store_dkim(dmp, (unsigned char *)d, dmx, NULL);
+					}
 					
 				}
 				/* msg2("sql ", sqlstr.s); */
@@ -317,11 +988,16 @@ static const response* arlog_message_end(int fd)
 	}
 
 	dkim_free(dk);
-	dkim_close(dl);
+	dk = 0;
+	dk_unfetch();
+	dm_join();
 
 	/* do DMARC stuff, log and do a-r */
 	if(fromdom.len) {
-		dms = opendmarc_policy_query_dmarc(dmp, NULL);
+		if(usepsl)
+			dms = dmarcfound > 0? DMARC_PARSE_OKAY: DMARC_DNS_ERROR_NO_RECORD;
+		else
+			dms = opendmarc_policy_query_dmarc(dmp, NULL);
 		if(dms == DMARC_PARSE_OKAY) {
 			char *dmres = "temperror";
 			int policy;
@@ -361,7 +1037,6 @@ static const response* arlog_message_end(int fd)
 			sqlquery(&sqlstr, NULL);
 		}
 	}
-	str_free(&sqlstr);
 
 	/* do this only so many percent */
 	if(doreject || doquarantine) {
@@ -382,62 +1057,66 @@ static const response* arlog_message_end(int fd)
 	if(dofail) {
 		unsigned char ruf[500];
 
-		if(opendmarc_policy_fetch_ruf(dmp, ruf, sizeof(ruf), 1))
+		/* the URIs as published, rufsend wants the mailto: */
+		if(opendmarc_policy_fetch_ruf(dmp, ruf, sizeof(ruf), 0)) {
 			session_setstr("dmarcruf", (char *)ruf);
+			ruf_record(fd, (char *)ruf, fromdom.s, ip, authservid);
+		}
 	}
 
 	if(fromdom.len) {
 		opendmarc_policy_connect_shutdown(dmp);
-		opendmarc_policy_library_shutdown(&dmarclib);
 	}
 
 	if(sump) return 0;	/* done, no a-r header, or it's a sump message */
 
 	if(doreject && dmrm && dmrm[0] == 'y') {
-		if (!dict_load_list(&dmnp, "control/nodmarcpolicy", 0, 0)) /* already in qmail dir */
-			return &resp_internal;
-		if(dict_get(&dmnp, &fromdom)) {
+		int np = ctl_lookup("control/nodmarcpolicy", &fromdom);
+
+		if(np < 0) return &resp_internal;
+		if(np) {
 			msg2("no dmarc policy for ", fromdom.s);
 		} else
 			session_setnum("dmarcreject", 1);
 	}
 	/* XXX nothing about doquarantine */
-	str_free(&fromdom);
 
 	if(!arstr.len) {
 		msg2("no ","arstr");
 		return 0;
 	}
-	if((newfd = scratchfile()) == -1) return &resp_internal;
-	obuf_init(&newob, newfd, 0, 0, 0);
-	if (lseek(fd, 0, SEEK_SET) != 0) return &resp_internal;
-	ibuf_init(&msgib, fd, 0, 0, 0);
+	/* ours at the top, any that came in with the message go */
+	if(!mh_parse(fd) || !med_check()) return &resp_internal;
+	if(!str_copy2s(&arhdr, "Authentication-Results: ", authservid)
+	   || !str_cat(&arhdr, &arstr)
+	   || !str_catc(&arhdr, LF)
+	   || !med_insert(0, arhdr.s, arhdr.len))
+		return &resp_oom;
+	for(i = mh_find("Authentication-Results", -1); i >= 0;
+	    i = mh_find("Authentication-Results", i)) {
+		const char *f = mh_field(i, &off, &len);
 
-	obuf_put2s(&newob, "Authentication-Results: ", authservid);
-	obuf_putstr(&newob, &arstr);
-	obuf_putc(&newob, '\n');
-
-	str_init(&msgstr);
-	while(ibuf_getstr(&msgib, &msgstr, LF)) {
-		/* check for existing A-R header from us and delete it */
-		if(str_case_match(&msgstr, &matchstr)) continue;
-		if(!obuf_putstr(&newob, &msgstr)) return &resp_internal;
+		if(!str_copyb(&arhdr, f, len)) return &resp_oom;
+		if(str_case_match(&arhdr, &armatch) && !med_delete(off, len))
+			return &resp_oom;
 	}
-	obuf_flush(&newob);
-	str_free(&msgstr);
-	str_free(&matchstr);
-
-	/* now replace the temp file */
-	dup2(newfd, fd);
-	close(newfd);
 	msg3("Authentication-Results: ", authservid, arstr.s);
 
 	return 0;
 }
 
+static const response* arlog_reset(void)
+{
+	ar_reset(AR_MSG);
+	return 0;
+}
+
 struct plugin plugin = {
 	.version = PLUGIN_VERSION,
 	.flags = FLAG_NEED_FILE,
+	.reset = arlog_reset,
 	.sender = arlog_sender,
+	.data_start = arlog_data_start,
+	.data_block = arlog_data_block,
 	.message_end = arlog_message_end,
 };
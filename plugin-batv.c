@@ -8,6 +8,12 @@
  *   control/nosigndoms  local domains that accept unsigned bounces
  * Env vars:
  *   NOBATV - don't do BATV on this message, passed from tcpserver
+ *   BATVSTORM - reject unsigned bounces at MAIL FROM from a client IP
+ *     or sender domain with this many recent bad BATV recipients
+ *   BATVDECAY - seconds for those counts to halve, default 600
+ *
+ * The storm counts are in the shared table "batvstorm", see shmtab.
+ * The sender domain of a null sender is its HELO name.
  */
 
 #include <unistd.h>
@@ -15,8 +21,6 @@
 #include "mailfront.h"
 #include "conf_qmail.c"
 #include <iobuf/ibuf.h>
-#include <dict/dict.h>
-#include <dict/load.h>
 #include <msg/msg.h>
 #include <openssl/md5.h>
 #include <sys/time.h>
@@ -26,40 +30,124 @@
 #define BATVSTALE 7		/* accept for a week */
 /* #define OLDBATV 1		** also accept prvs=user=sig */
 
-static int isbounce;
-static dict nosign;
+extern int ctl_lookup(const char *file, str *key);
+extern int ar_str(int a, str *out, const char *s, unsigned long len);
+extern void ar_reset(int a);
+#define AR_MSG 0
+extern int shm_open_table(const char *name, unsigned nslots, unsigned vsize);
+extern int shm_lock(int t);
+extern int shm_unlock(int t);
+extern void* shm_find(int t, const char *key, unsigned klen, int create, unsigned ttl);
+extern void shm_expire(int t, void *val, unsigned ttl);
 
-static dict nosigndoms;
-static int nsdloaded;
+static int isbounce;
 static str signkey;
 
-static RESPONSE(no_chdir,451,"4.3.0 Could not change to the qmail directory.");
+struct storm {
+  unsigned count;		/* bad BATV, halved every BATVDECAY */
+  time_t last;
+};
+
+static int stormtab = -2;
+static str stormip;		/* keys for this client */
+static str stormdom;
 static RESPONSE(batv,553, "Not our message (5.7.1)");
+static RESPONSE(batvstorm,553, "Too many bounces for messages we didn't send (5.7.1)");
+
+/* age the count, and add n to it, return the new count */
+static unsigned storm_count(str *key, unsigned n)
+{
+  struct storm *st;
+  char *s = getenv("BATVDECAY");
+  unsigned long decay = s ? strtoul(s, 0, 10) : 600;
+  unsigned count = 0;
+  time_t now = time(0);
+
+  if(!decay) decay = 1;
+  if(stormtab == -2) stormtab = shm_open_table("batvstorm", 4096, sizeof(struct storm));
+  if(stormtab < 0 || !shm_lock(stormtab)) return 0;
+  if((st = shm_find(stormtab, key->s, key->len, n > 0, 16*decay)) != 0) {
+    unsigned long halvings = (now - st->last) / decay;
+
+    if(halvings >= 32) st->count = 0;
+    else if(halvings) st->count >>= halvings;
+    if(halvings) st->last += halvings * decay;
+    if(!st->last) st->last = now;
+    if(n) {
+      st->count += n;
+      shm_expire(stormtab, st, 16*decay);
+    }
+    count = st->count;
+  }
+  shm_unlock(stormtab);
+  return count;
+}
+
+/* BATVSTORM, 0 if storms aren't being checked */
+static unsigned long storm_limit(void)
+{
+  char *s = getenv("BATVSTORM");
+
+  return s ? strtoul(s, 0, 10) : 0;
+}
+
+/* note a bad BATV bounce from this client, keyed by storm_check */
+static void storm_bump(void)
+{
+  if(!storm_limit() || !stormip.len) return;
+  storm_count(&stormip, 1);
+  if(stormdom.len > 1) storm_count(&stormdom, 1);
+}
+
+/* is this client in the middle of a backscatter storm? */
+static int storm_check(str *sender)
+{
+  const char *ip = getprotoenv("REMOTEIP");
+  const char *helo;
+  unsigned long limit;
+
+  if(!(limit = storm_limit())) return 0;
+
+  str_copy2s(&stormip, "i", ip ? ip : "");
+  str_copys(&stormdom, "d");
+  if(sender->len) str_catb(&stormdom, sender->s+14, sender->len-14);
+  else if((helo = session_getstr("helo_domain")) != 0) str_cats(&stormdom, helo);
+  str_lower(&stormdom);
+
+  if(storm_count(&stormip, 0) >= limit
+     || (stormdom.len > 1 && storm_count(&stormdom, 0) >= limit)) {
+    storm_bump();		/* keep it going while they keep at it */
+    return 1;
+  }
+  return 0;
+}
 
 static const response* batv_sender(str* sender, str* param)
 {
-  const char *qh;
   str domstr;
+  int ns;
 
   isbounce = 0;
   if(sender->len == 0) {		/* actual bounce */
     if(!getenv("NOBATV")) isbounce = 1;
-    return 0;
+    goto storm;
   }
 
   if(!str_case_starts(sender, "mailer-daemon@")) return 0;
 
   /* for mailer daemon, have to check nosign */
 
-  if ((qh = getenv("QMAILHOME")) == 0)
-    qh = conf_qmail;
-  if (chdir(qh) == -1) return &resp_no_chdir;
-  if (!dict_load_list(&nosign, "control/nosign", 0, 0))
-    return &resp_internal;
-  str_init(&domstr);
-  str_copyb(&domstr, sender->s+14, sender->len-14);
-  if(!dict_get(&nosign, &domstr)) isbounce = 1; /* do batv */
+  if(!ar_str(AR_MSG, &domstr, sender->s+14, sender->len-14)) return &resp_oom;
+  ns = ctl_lookup("control/nosign", &domstr);
+  if(ns < 0) return &resp_internal;
+  if(!ns) isbounce = 1; /* do batv */
 
+ storm:
+  if(isbounce && storm_check(sender)) {
+    msg2("batv storm from ", stormip.s+1);
+    session_setnum("badbatv", 1);
+    return &resp_batvstorm;
+  }
   return 0;
   (void)param;
 }
@@ -178,37 +266,36 @@ static int bvunwrap(str* address)
 static const response* batv_recipient(str* recipient, str* param)
 {
   str domstr;
-  int i;
+  int i, ns;
 
   if(bvunwrap(recipient)) return 0; /* it was signed, we're done */
   if(!isbounce) return 0;	/* not a bounce, we're done */
 
   /* check if it's a domain that accepts unsigned bounces */
-  if(!nsdloaded) {
-    const char* qh;
-
-    if ((qh = getenv("QMAILHOME")) == 0)
-      qh = conf_qmail;
-    if (chdir(qh) == -1) return &resp_no_chdir;
-    if (!dict_load_list(&nosigndoms, "control/nosigndoms", 0, 0))
-      return &resp_internal;
-    nsdloaded = 1;
-  }
-  str_init(&domstr);
   i = str_findlast(recipient, '@');
   if(i < 0) return 0;		/* no domain, huh? */
   i++;
-  str_copyb(&domstr, recipient->s+i, recipient->len-i);
-  if(dict_get(&nosigndoms, &domstr)) return 0; /* unsigned OK */
+  if(!ar_str(AR_MSG, &domstr, recipient->s+i, recipient->len-i)) return &resp_oom;
+  ns = ctl_lookup("control/nosigndoms", &domstr);
+  if(ns < 0) return &resp_internal;
+  if(ns) return 0; /* unsigned OK */
 
   session_setnum("badbatv", 1);
+  storm_bump();
   return &resp_batv;
   (void)param;
 }
 
+static const response* batv_reset(void)
+{
+  ar_reset(AR_MSG);
+  return 0;
+}
+
 struct plugin plugin = {
   .version = PLUGIN_VERSION,
   .flags = 0,
+  .reset = batv_reset,
   .sender = batv_sender,
   .recipient = batv_recipient,
 };
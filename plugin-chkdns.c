@@ -6,7 +6,9 @@
  * Has to come before anything that might accept a sender
  * everything except non-existent MAIL FROM sends mail to sump
  * or rejects if DBLREJECT is set
- * 
+ * Names and DBL text are built in arena.so's per-message arena, not
+ * malloc'd; a HELO's DBL text is then kept in one buffer reused by the
+ * next HELO, so repeated HELOs don't pile up
  */
 
 #include <stdlib.h>
@@ -20,12 +22,18 @@
 
 #include <msg/msg.h>
 
+#define AR_MSG 0
+extern char *ar_cat(int a, const char *s, ...);
+extern int ar_str(int a, str *out, const char *s, unsigned long len);
+extern void ar_reset(int a);
+
 static RESPONSE(badfrom,553,"5.1.8 Invalid sender domain.");
 static response resp_baddbl = { 553, "???" };
 
-static int dblchk(str *domain, str *dbltxt)
+/* dbltxt comes from arena a */
+static int dblchk(str *domain, str *dbltxt, int a)
 {
-	str dblstr;
+	const char *dblstr;
 	char *dbl = getenv("DBLLOOKUP");
 	int l, i;
 	unsigned char ansbuf[512];
@@ -34,12 +42,9 @@ static int dblchk(str *domain, str *dbltxt)
 	if(session_getnum("sump",0)) return 0; /* no point */
 
 
-	str_init(&dblstr);
-	str_copy(&dblstr, domain);
-	str_catc(&dblstr, '.');
-	str_cats(&dblstr, dbl);
+	if((dblstr = ar_cat(AR_MSG, domain->s, ".", dbl, (char *)0)) == 0) return 0;
 			
-	l = res_query(dblstr.s, C_IN, T_TXT, ansbuf, sizeof(ansbuf));
+	l = res_query(dblstr, C_IN, T_TXT, ansbuf, sizeof(ansbuf));
 	if(l > 0 && ((HEADER *)ansbuf)->ancount != 0) {  /* something in the answer */
 		unsigned char *recbuf = ansbuf+NS_HFIXEDSZ;
 		
@@ -56,30 +61,28 @@ static int dblchk(str *domain, str *dbltxt)
 				continue;
 			}
 			/* it's a TXT record, wow */
-			str_init(dbltxt);
-			str_copyb(dbltxt, (char*)recbuf+11, recbuf[10]);
-			str_free(&dblstr);
-			return 1;
+			return ar_str(a, dbltxt, (char*)recbuf+11, recbuf[10]);
 		}
 	} /* didn't find anything */
-	str_free(&dblstr);
 	return 0;
 	}
 
 static const response* chkdns_helo(str* hostname, str* capabilities)
 {
+	static str helotxt;	/* outlasts the reset at HELO, reused each time */
 	str dbltxt;
 
 	/* hack, don't check numeric, guess from first character */
 	if(hostname->s[0] >= '0' && hostname->s[0] <= '9') return 0;
 
-	if(dblchk(hostname, &dbltxt)) {
-		session_setenv("RBLSMTPD", dbltxt.s, 0);
+	if(dblchk(hostname, &dbltxt, AR_MSG)) {
+		if(!str_copy(&helotxt, &dbltxt)) return &resp_oom;
+		session_setenv("RBLSMTPD", helotxt.s, 0);
 		session_setnum("dblhelo", 1);
 		session_setnum("sump", 1);
-		msg4("HELO ", hostname->s, " in DBL ",dbltxt.s);
+		msg4("HELO ", hostname->s, " in DBL ",helotxt.s);
 		if(getenv("DBLREJECT")) {
-			resp_baddbl.message = dbltxt.s;
+			resp_baddbl.message = helotxt.s;
 			return &resp_baddbl;
 		}
 	}
@@ -100,20 +103,17 @@ static const response* chkdns_sender(str* sender, str* params)
 	if(i < 0) {
 		return &resp_badfrom;	/* no domain */
 	}
-	str_init(&domstr);
-	str_copyb(&domstr, sender->s+i+1, sender->len-i-1);
-	if(domstr.len == 0) { /* null domain */
-		str_free(&domstr);
+	if(sender->len-i-1 == 0) /* null domain */
 		return &resp_badfrom;
-	}
+	if(!ar_str(AR_MSG, &domstr, sender->s+i+1, sender->len-i-1))
+		return &resp_oom;
 
 	/* first check dbl */
-	if(dblchk(&domstr, &dbltxt)) {
+	if(dblchk(&domstr, &dbltxt, AR_MSG)) {
 		session_setenv("RBLSMTPD", dbltxt.s, 0);
 		session_setnum("dblfrom", 1);
 		session_setnum("sump", 1);
 		msg2("MAIL FROM in DBL ",dbltxt.s);
-		str_free(&domstr);
 		if(getenv("DBLREJECT")) {
 			resp_baddbl.message = dbltxt.s;
 			return &resp_baddbl;
@@ -122,28 +122,30 @@ static const response* chkdns_sender(str* sender, str* params)
 	}
 
 	i = res_query(domstr.s, C_IN, T_MX, ansbuf, sizeof(ansbuf));
-	if(i > 0 && ((HEADER *)ansbuf)->ancount != 0) {  /* has an MX */
-		str_free(&domstr);
+	if(i > 0 && ((HEADER *)ansbuf)->ancount != 0)  /* has an MX */
 		return 0;
-	}
 
 	i = res_query(domstr.s, C_IN, T_A, ansbuf, sizeof(ansbuf));
-	if(i > 0 && ((HEADER *)ansbuf)->ancount != 0) { /* has an A */
-		str_free(&domstr);
+	if(i > 0 && ((HEADER *)ansbuf)->ancount != 0) /* has an A */
 		return 0;
-		}
 
 	i = res_query(domstr.s, C_IN, T_AAAA, ansbuf, sizeof(ansbuf));
-	str_free(&domstr);
 	if(i > 0 && ((HEADER *)ansbuf)->ancount != 0) return 0; /* has an AAAA */
 
 	return &resp_badfrom;
 	(void)params;
 }
 
+static const response* chkdns_reset(void)
+{
+	ar_reset(AR_MSG);
+	return 0;
+}
+
 struct plugin plugin = {
   .version = PLUGIN_VERSION,
   .flags = 0,
+  .reset = chkdns_reset,
   .helo = chkdns_helo,
   .sender = chkdns_sender,
 };
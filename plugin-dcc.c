@@ -1,16 +1,38 @@
 /*
  * Run the message through DCC via dccifd
  * Socket name in DCC_SOCKET
+ * DCC_TIMEOUT seconds to wait for dccifd, default 30
+ * Skipped while the "dcc" breaker is open, see breaker.c,
+ * and for duplicates found by plugin-dedup
+ * The header comes from msghdr's index, and the new X-DCC header
+ * replaces the old ones through the msgedit journal, the spool file
+ * isn't copied
+ * Needs backend-qmailsump or backend-spool, which apply the journal;
+ * with any other backend the message is refused rather than sent on
+ * without the edits
  */
 
 #include <unistd.h>
 #include <string.h>
+#include <sys/time.h>
 #include "mailfront.h"
 #include <net/socket.h>
 #include <iobuf/ibuf.h>
 #include <iobuf/obuf.h>
 #include <msg/msg.h>
 
+extern int brk_allow(const char *name);
+extern void brk_report(const char *name, int ok, unsigned long ms, unsigned long slowms);
+extern int med_insert(off_t off, const char *text, unsigned long len);
+extern int med_delete(off_t off, off_t len);
+extern int med_check(void);
+extern int mh_parse(int fd);
+extern int mh_count(void);
+extern off_t mh_end(void);
+extern off_t mh_body(void);
+extern int mh_prefix(const char *prefix, int prev);
+extern const char* mh_field(int i, off_t *off, unsigned long *len);
+
 static str dccsender;
 static str dccrecips;
 
@@ -18,7 +40,7 @@ static str dccrecips;
 static const response* dcc_sender(str* sender, str* param)
 {
   if(!str_copy(&dccsender, sender))return &resp_oom;
-  str_init(&dccrecips);
+  str_truncate(&dccrecips, 0);
 
   return 0;
   (void)param;
@@ -39,31 +61,51 @@ static const response* dcc_recipient(str* recipient, str* param)
   (void)param;
 }
 
-/* now run it through DCC, and recopy to a new file */
+static unsigned long ms_since(const struct timeval *start)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec - start->tv_sec) * 1000
+    + (tv.tv_usec - start->tv_usec) / 1000;
+}
+
+/* now run it through DCC, and note the new X-DCC header */
 static const response* dcc_message_end(int fd)
 {
   char *sockname = getenv("DCC_SOCKET");
-  unsigned bodystart = 0;		/* offset of message body */
+  char *tmo = getenv("DCC_TIMEOUT");
+  unsigned long tmoms = 1000 * (tmo ? atoi(tmo) : 30);
+  struct timeval start;
+  off_t off;
+  unsigned long len;
   const char *s;
   int sockfd;
-  int newfd;
+  int i, x;
   obuf dccob;
   ibuf dccib;
   ibuf msgib;
-  obuf newob;
-  str msgstr;
-  str retstr;
+  static str retstr;
   int sump = session_getnum("sump", 0);
 
-
-  if(!sump && (newfd = scratchfile()) == -1) return &resp_internal;
+  if(session_getnum("dupmsg", 0)) return 0; /* scanned the first copy */
 
   if(!sockname) return 0;
+  if(!mh_parse(fd) || !med_check()) return &resp_internal;
+  if(!brk_allow("dcc")) {
+    msg1("dcc breaker open, skipping");
+    session_setnum("scanskip", 1);
+    return 0;
+  }
+  gettimeofday(&start, NULL);
 
   if(!(sockfd = socket_unixstr())) return 0;
-  if(!socket_connectu(sockfd, sockname)) return 0;
+  if(!socket_connectu(sockfd, sockname)) {
+    brk_report("dcc", 0, 0, 0);
+    return 0;
+  }
   obuf_init(&dccob, sockfd, 0, 0, 0);
-  if(!sump) obuf_init(&newob, newfd, 0, 0, 0);
+  dccob.io.timeout = tmoms;
 
   /* now send the DCC header */
   /* control info */
@@ -86,57 +128,54 @@ static const response* dcc_message_end(int fd)
   obuf_putstr(&dccob, &dccrecips);
   obuf_putc(&dccob, LF);
 
-  /* now blat out the whole message */
-
-  /* can't use ibuf_rewind, it thinks it's already there */
-  if (lseek(fd, 0, SEEK_SET) != 0) return &resp_internal;
-  ibuf_init(&msgib, fd, 0, 0, 0);
-
-  str_init(&msgstr);
-  str_init(&retstr);
-
-  /* copy header to dcc and new msg, discard existing X-DCC */
-  /* copy body to dcc */
-  while(ibuf_getstr(&msgib, &msgstr, LF)) {
-    if(!bodystart) { /* in header */
-      if(str_starts(&msgstr, "X-DCC-")) continue;
-      if(msgstr.s[0] == LF) bodystart = ibuf_tell(&msgib);
-      else if(!sump) obuf_putstr(&newob, &msgstr);
+  /* now blat out the whole message, header less any old X-DCC from
+     the index, then the rest straight from the file */
+  x = mh_prefix("X-DCC-", -1);
+  for(i = 0; i < mh_count(); i++) {
+    s = mh_field(i, &off, &len);
+    if(i == x) {
+      x = mh_prefix("X-DCC-", i);
+      continue;
     }
-    obuf_putstr(&dccob, &msgstr);
+    obuf_write(&dccob, s, len);
   }
+  if (lseek(fd, mh_end(), SEEK_SET) != mh_end()) return &resp_internal;
+  ibuf_init(&msgib, fd, 0, 0, 0);
+  iobuf_copy(&msgib, &dccob);
   obuf_flush(&dccob);
 
+  str_truncate(&retstr, 0);
+
   /* shutdown output and see what happened */
   socket_shutdown(sockfd, 0, 1);
   ibuf_init(&dccib, sockfd, 0, IOBUF_NEEDSCLOSE, 0);
+  dccib.io.timeout = tmoms;
 
-  /* summary */
-  if(!ibuf_getstr(&dccib, &retstr, LF)) return &resp_internal;
+  /* summary, per recipient, new X-DCC line */
+  if(!ibuf_getstr(&dccib, &retstr, LF)) goto failed;
   str_rstrip(&retstr);
   msg2("dcc said ",retstr.s);
-
-  /* per recipient */
-  if(!ibuf_getstr(&dccib, &retstr, LF)) return &resp_internal;
-
-  /* new X-DCC line */
-  if(!ibuf_getstr(&dccib, &retstr, LF)) return &resp_internal;
+  if(!ibuf_getstr(&dccib, &retstr, LF)
+     || !ibuf_getstr(&dccib, &retstr, LF)) goto failed;
   ibuf_close(&dccib);
+  brk_report("dcc", 1, ms_since(&start), tmoms/2);
 
   if(sump) return 0;	     /* no new info if we said spam, no rewrite */
 
-  obuf_putstr(&newob, &retstr);
-  obuf_putc(&newob, LF);	/* end of header */
-
-  if(bodystart) {
-    ibuf_seek(&msgib, bodystart);
-    if(!iobuf_copyflush(&msgib, &newob)) return &resp_internal;
+  for(i = mh_prefix("X-DCC-", -1); i >= 0; i = mh_prefix("X-DCC-", i)) {
+    mh_field(i, &off, &len);
+    if(!med_delete(off, len)) return &resp_oom;
   }
+  /* at the end of the header, with a blank line if there wasn't one */
+  if(mh_body() == mh_end() && !str_catc(&retstr, LF)) return &resp_oom;
+  if(!med_insert(mh_end(), retstr.s, retstr.len)) return &resp_oom;
 
-  /* now replace the temp file */
-  dup2(newfd, fd);
-  close(newfd);
+  return 0;
 
+ failed:			/* dccifd didn't answer, carry on without it */
+  msg1("dcc failed or timed out");
+  ibuf_close(&dccib);
+  brk_report("dcc", 0, ms_since(&start), tmoms/2);
   return 0;
 }
 
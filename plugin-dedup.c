@@ -0,0 +1,164 @@
+/*
+ * Spot client retries of a message we've already taken, so they get
+ * the answer the first copy got instead of being scanned and queued
+ * again.  Put it first in PLUGINS so the scanners can skip duplicates.
+ *
+ * The key is a hash of the Message-ID, the envelope, and the body.
+ * Messages without a Message-ID aren't checked.  Sets session
+ *   msghash - hex key, for the backend to store its response under
+ *   dupmsg - 1 if the backend has a response for this key
+ * Responses are in the shared table "dedup", see shmtab
+ * DEDUPTTL: seconds to remember a response, default 600
+ */
+
+#include <string.h>
+#include <strings.h>
+#include "mailfront.h"
+#include <msg/msg.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+extern int shm_open_table(const char *name, unsigned nslots, unsigned vsize);
+extern int shm_fetch(int t, const char *key, unsigned klen, void *val);
+
+/* as stored by the backend */
+struct dedupresp {
+  unsigned number;
+  char message[256];
+};
+
+static EVP_MD_CTX *dupsha;
+static EVP_MD_CTX *ksha;
+static str dupenv;		/* sender and recipients */
+static str dupline;		/* header being collected */
+static str dupphys;		/* physical line being collected */
+static str dupmsgid;
+static int dupinbody;
+
+static const response* dedup_reset(void)
+{
+  session_delnum("dupmsg");
+  session_setstr("msghash", "");
+  return 0;
+}
+
+static const response* dedup_sender(str* sender, str* param)
+{
+  if(!str_copy(&dupenv, sender) || !str_catc(&dupenv, 0)) return &resp_oom;
+  return 0;
+  (void)param;
+}
+
+static const response* dedup_recipient(str* recipient, str* param)
+{
+  if(!str_cat(&dupenv, recipient) || !str_catc(&dupenv, 0)) return &resp_oom;
+  return 0;
+  (void)param;
+}
+
+static const response* dedup_data_start(int fd)
+{
+  if(!dupsha && ((dupsha = EVP_MD_CTX_new()) == 0
+		 || (ksha = EVP_MD_CTX_new()) == 0)) {
+    EVP_MD_CTX_free(dupsha);
+    dupsha = 0;
+    return &resp_oom;
+  }
+  if(!EVP_DigestInit_ex(dupsha, EVP_sha256(), 0)) return &resp_internal;
+  str_truncate(&dupline, 0);
+  str_truncate(&dupphys, 0);
+  str_truncate(&dupmsgid, 0);
+  dupinbody = 0;
+  return 0;
+  (void)fd;
+}
+
+/* keep the Message-ID, handles continuation lines */
+static int header_line(void)
+{
+  if(dupline.len == 0) return 1;
+  if(!dupmsgid.len && !strncasecmp(dupline.s, "message-id:", 11)) {
+    if(!str_copyb(&dupmsgid, dupline.s+11, dupline.len-11)) return 0;
+    str_strip(&dupmsgid);
+  }
+  str_truncate(&dupline, 0);
+  return 1;
+}
+
+/* one physical header line in dupphys */
+static int phys_line(void)
+{
+  if(dupphys.s[0] == LF || (dupphys.s[0] == '\r' && dupphys.len == 2)) {
+    dupinbody = 1;		/* the blank line */
+    return header_line();
+  }
+  if(dupphys.s[0] != ' ' && dupphys.s[0] != '\t' && !header_line())
+    return 0;
+  return str_cat(&dupline, &dupphys);
+}
+
+static const response* dedup_data_block(const char* bytes, unsigned long len)
+{
+  const char *nl;
+  unsigned long n;
+
+  while(len > 0 && !dupinbody) {
+    nl = memchr(bytes, LF, len);
+    n = nl ? (unsigned long)(nl - bytes) + 1 : len;
+    if(!str_catb(&dupphys, bytes, n)) return &resp_oom;
+    bytes += n;
+    len -= n;
+    if(nl) {
+      if(!phys_line()) return &resp_oom;
+      str_truncate(&dupphys, 0);
+    }
+  }
+  if(len > 0 && !EVP_DigestUpdate(dupsha, bytes, len)) return &resp_internal;
+  return 0;
+}
+
+static const response* dedup_message_end(int fd)
+{
+  static int deduptab = -2;
+  static const char hex[] = "0123456789abcdef";
+  unsigned char hash[SHA256_DIGEST_LENGTH];
+  struct dedupresp resp;
+  char key[2*SHA256_DIGEST_LENGTH+1];
+  unsigned i;
+
+  if(!dupinbody && !header_line()) return &resp_oom;
+  if(!dupmsgid.len) return 0;
+
+  /* hash the body hash with the rest of the key */
+  if(!EVP_DigestFinal_ex(dupsha, hash, 0)
+     || !EVP_DigestInit_ex(ksha, EVP_sha256(), 0)
+     || !EVP_DigestUpdate(ksha, dupmsgid.s, dupmsgid.len+1)
+     || !EVP_DigestUpdate(ksha, dupenv.s, dupenv.len)
+     || !EVP_DigestUpdate(ksha, hash, sizeof hash)
+     || !EVP_DigestFinal_ex(ksha, hash, 0))
+    return &resp_internal;
+  for(i = 0; i < sizeof hash; i++) {
+    key[2*i] = hex[hash[i] >> 4];
+    key[2*i+1] = hex[hash[i] & 15];
+  }
+  key[2*i] = 0;
+  session_setstr("msghash", key);
+
+  if(deduptab == -2) deduptab = shm_open_table("dedup", 4096, sizeof resp);
+  if(shm_fetch(deduptab, key, sizeof key - 1, &resp)) {
+    msg2("duplicate of message ", dupmsgid.s);
+    session_setnum("dupmsg", 1);
+  }
+  return 0;
+  (void)fd;
+}
+
+struct plugin plugin = {
+  .version = PLUGIN_VERSION,
+  .reset = dedup_reset,
+  .sender = dedup_sender,
+  .recipient = dedup_recipient,
+  .data_start = dedup_data_start,
+  .data_block = dedup_data_block,
+  .message_end = dedup_message_end,
+};
@@ -0,0 +1,270 @@
+/*
+ * DKIM sign mail from authenticated senders as it comes in
+ *
+ * control/dkimkeys has a line per signing domain
+ *   domain:selector:keyfile
+ *   domain:selector:keyfile:ed25519
+ * keyfile is a PEM private key, relative to QMAILHOME unless it starts
+ * with /.  The envelope sender's domain picks the line, looked up in
+ * the shared index ctlcache makes, so there's no per-message parsing.
+ * Keys are read once per process and reread when the file changes.
+ *
+ * Mail is signed if the session is authenticated or RELAYCLIENT is
+ * set, and isn't for the sump.  The body goes to opendkim from
+ * data_block, so at message_end only the final hashing is left.  The
+ * DKIM-Signature: header goes in the msgedit journal at the front of
+ * the message, so the message isn't copied to add it.  That needs
+ * backend-qmailsump or backend-spool, which apply the journal; with any
+ * other backend the message is refused rather than sent on unsigned.
+ *
+ * DKIMSIGNSTATS: log how long signing took at message_end, in usec
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "mailfront.h"
+#include "conf_qmail.c"
+#include <msg/msg.h>
+#include <str/str.h>
+
+#include <opendkim/dkim.h>
+
+extern int ctl_lookupval(const char *file, str *key, str *val);
+extern int med_insert(off_t off, const char *text, unsigned long len);
+extern int med_check(void);
+
+#define DKCHUNK 65536
+#define MAXKEYS 16
+
+static DKIM_LIB *signlib;
+static DKIM *dks;
+static int dkstop;
+static str dkbuf;		/* batched up for dkim_chunk */
+static str signdom;		/* from the sender, empty for no signing */
+static str signsel;
+static str signkeyfile;
+static int signalg;
+static str sighdr;
+
+/* private keys we've read */
+static struct signkey {
+  str path;
+  struct stat st;
+  str pem;
+} signkeys[MAXKEYS];
+static int nsignkeys;
+
+static DKIM_LIB *get_signlib(void)
+{
+  unsigned int opts = DKIM_LIBFLAGS_FIXCRLF;
+  DKIM_STAT ds;
+
+  if(signlib) return signlib;
+  if((signlib = dkim_init(NULL, NULL)) == 0) {
+    msg1("dkim_init failed");
+    return 0;
+  }
+  ds = dkim_options(signlib, DKIM_OP_SETOPT, DKIM_OPTS_FLAGS, &opts, sizeof(opts));
+  if(ds != DKIM_STAT_OK) {
+    msg2("dkim_options failed: ", dkim_getresultstr(ds));
+    dkim_close(signlib);
+    signlib = 0;
+  }
+  return signlib;
+}
+
+/* the key in keyfile, read again only if it's changed */
+static const char* get_key(const str *keyfile)
+{
+  static str path;
+  struct signkey *k;
+  struct stat st;
+  const char *qh;
+  int fd, i;
+
+  if(keyfile->s[0] == '/') {
+    if(!str_copy(&path, keyfile)) return 0;
+  }
+  else {
+    if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+    if(!str_copy2s(&path, qh, "/") || !str_cat(&path, keyfile)) return 0;
+  }
+  if(stat(path.s, &st) != 0) {
+    msg2("can't stat DKIM key ", path.s);
+    return 0;
+  }
+
+  for(i = 0; i < nsignkeys; i++)
+    if(!str_diff(&signkeys[i].path, &path)) break;
+  k = &signkeys[i < MAXKEYS ? i : MAXKEYS-1];	/* reuse the last if full */
+  if(i < nsignkeys && st.st_ino == k->st.st_ino && st.st_dev == k->st.st_dev
+     && st.st_mtime == k->st.st_mtime && st.st_size == k->st.st_size)
+    return k->pem.s;
+  if(i == nsignkeys && nsignkeys < MAXKEYS) nsignkeys++;
+
+  if(!str_copy(&k->path, &path) || !str_ready(&k->pem, st.st_size)) return 0;
+  if((fd = open(path.s, O_RDONLY)) < 0
+     || read(fd, k->pem.s, st.st_size) != st.st_size) {
+    msg2("can't read DKIM key ", path.s);
+    if(fd >= 0) close(fd);
+    str_truncate(&k->path, 0);
+    return 0;
+  }
+  close(fd);
+  k->pem.len = st.st_size;
+  k->pem.s[k->pem.len] = 0;
+  k->st = st;
+  return k->pem.s;
+}
+
+static void dk_flush(void)
+{
+  DKIM_STAT ds;
+
+  if(dks && !dkstop && dkbuf.len) {
+    ds = dkim_chunk(dks, (unsigned char *)dkbuf.s, dkbuf.len);
+    if(ds != DKIM_STAT_OK) {
+      msg2("dkim_chunk failed: ", dkim_getresultstr(ds));
+      dkstop = 1;
+    }
+  }
+  str_truncate(&dkbuf, 0);
+}
+
+static const response* dkimsign_reset(void)
+{
+  if(dks) dkim_free(dks);
+  dks = 0;
+  str_truncate(&signdom, 0);
+  return 0;
+}
+
+static const response* dkimsign_sender(str* sender, str* params)
+{
+  static str val;
+  const char *at;
+  const char *rc = session_getenv("RELAYCLIENT");
+  const char *sump = session_getenv("SUMPDOMAIN");
+  int i;
+
+  str_truncate(&signdom, 0);
+  if(!session_getnum("authenticated", 0) && !rc) return 0;
+  if(sump && rc && !strcmp(sump, rc)) return 0;
+  if((at = strrchr(sender->s, '@')) == 0 || !at[1]) return 0;
+
+  if(!str_copys(&signdom, at+1)) return &resp_oom;
+  str_lower(&signdom);
+  if(ctl_lookupval("control/dkimkeys", &signdom, &val) != 1) {
+    str_truncate(&signdom, 0);
+    return 0;
+  }
+
+  /* selector:keyfile[:ed25519] */
+  signalg = DKIM_SIGN_RSASHA256;
+  for(i = 0; i < (int)val.len && val.s[i] != ':'; i++)
+    ;
+  if(i == 0 || i == (int)val.len) {
+    msg2("bad control/dkimkeys line for ", signdom.s);
+    str_truncate(&signdom, 0);
+    return 0;
+  }
+  if(!str_copyb(&signsel, val.s, i)) return &resp_oom;
+  str_lcut(&val, i+1);
+  if(val.len > 8 && !strcasecmp(val.s + val.len - 8, ":ed25519")) {
+    signalg = DKIM_SIGN_ED25519SHA256;
+    str_truncate(&val, val.len - 8);
+  }
+  if(!str_copy(&signkeyfile, &val)) return &resp_oom;
+  return 0;
+  (void)params;
+}
+
+static const response* dkimsign_data_start(int fd)
+{
+  DKIM_LIB *dl;
+  DKIM_STAT ds;
+  const char *key;
+
+  if(dks) dkim_free(dks);
+  dks = 0;
+  dkstop = 0;
+  str_truncate(&dkbuf, 0);
+  if(!signdom.len) return 0;
+
+  if((dl = get_signlib()) == 0 || (key = get_key(&signkeyfile)) == 0) return 0;
+  dks = dkim_sign(dl, (unsigned char *)"msg", NULL, (dkim_sigkey_t)key,
+		  (unsigned char *)signsel.s, (unsigned char *)signdom.s,
+		  DKIM_CANON_RELAXED, DKIM_CANON_RELAXED, signalg, -1L, &ds);
+  if(!dks) msg2("dkim_sign failed: ", dkim_getresultstr(ds));
+  return 0;
+  (void)fd;
+}
+
+static const response* dkimsign_data_block(const char* bytes, unsigned long len)
+{
+  if(!dks || dkstop) return 0;
+  if(!str_catb(&dkbuf, bytes, len)) return &resp_oom;
+  if(dkbuf.len >= DKCHUNK) dk_flush();
+  return 0;
+}
+
+static const response* dkimsign_message_end(int fd)
+{
+  struct timeval start, now;
+  unsigned char *hdr;
+  size_t hlen, i;
+  DKIM_STAT ds;
+
+  if(!dks) return 0;
+  gettimeofday(&start, NULL);
+
+  dk_flush();
+  if(dkstop) goto done;
+  dkim_chunk(dks, NULL, 0);
+  if((ds = dkim_eom(dks, NULL)) != DKIM_STAT_OK) {
+    msg2("dkim_eom failed: ", dkim_getresultstr(ds));
+    goto done;
+  }
+  ds = dkim_getsighdr_d(dks, sizeof "DKIM-Signature: " - 1, &hdr, &hlen);
+  if(ds != DKIM_STAT_OK) {
+    msg2("dkim_getsighdr_d failed: ", dkim_getresultstr(ds));
+    goto done;
+  }
+
+  /* qmail wants bare LF */
+  if(!str_copys(&sighdr, "DKIM-Signature: ")) return &resp_oom;
+  for(i = 0; i < hlen; i++)
+    if(hdr[i] != '\r' && !str_catc(&sighdr, hdr[i])) return &resp_oom;
+  if(!str_catc(&sighdr, '\n')) return &resp_oom;
+  if(!med_check()) return &resp_internal;
+  if(!med_insert(0, sighdr.s, sighdr.len)) return &resp_oom;
+
+  if(session_getenv("DKIMSIGNSTATS")) {
+    gettimeofday(&now, NULL);
+    str_copys(&sighdr, "dkim signed ");
+    str_cat(&sighdr, &signdom);
+    str_cats(&sighdr, " usec ");
+    str_catu(&sighdr, (now.tv_sec - start.tv_sec) * 1000000 + now.tv_usec - start.tv_usec);
+    msg1(sighdr.s);
+  }
+ done:
+  dkim_free(dks);
+  dks = 0;
+  return 0;
+  (void)fd;
+}
+
+struct plugin plugin = {
+  .version = PLUGIN_VERSION,
+  .flags = FLAG_NEED_FILE,
+  .reset = dkimsign_reset,
+  .sender = dkimsign_sender,
+  .data_start = dkimsign_data_start,
+  .data_block = dkimsign_data_block,
+  .message_end = dkimsign_message_end,
+};
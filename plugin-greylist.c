@@ -1,6 +1,8 @@
 /* 
  * Greylist via daemon
  * Daemon address in GREYIP
+ * GREY_TIMEOUT seconds to wait for it, default 3
+ * Skipped while the "greylist" breaker is open, see breaker.c
  *
  * Has to come after anything else that might reject a recipient
  * But before anything else that might accept one
@@ -8,6 +10,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <sys/time.h>
 
 #include "mailfront.h"
 #include <net/socket.h>
@@ -20,6 +23,9 @@ static ipv4port greyport = 1999;
 
 static RESPONSE(grey,451,"4.4.5 Try again later.");
 
+extern int brk_allow(const char *name);
+extern void brk_report(const char *name, int ok, unsigned long ms, unsigned long slowms);
+
 /* collect envelope info for later query */
 
 static const response* grey_sender(str* sender, str* param)
@@ -50,6 +56,9 @@ static const response* grey_data_start(int fd)
 {
   fd_set fs;
   struct timeval fst;
+  struct timeval start, end;
+  char *tmo = getenv("GREY_TIMEOUT");
+  unsigned long tmoms = 1000 * (tmo ? atoi(tmo) : 3);
   int r;
   char rbuf[2];
   ipv4addr raddr;
@@ -67,14 +76,26 @@ static const response* grey_data_start(int fd)
     if((greysocket = socket_udp4()) < 0) return 0;
   }
 
+  if(!brk_allow("greylist")) {
+    session_setnum("scanskip", 1);
+    return 0;
+  }
+  gettimeofday(&start, NULL);
+
   if(!socket_send4(greysocket, greymsg.s, greymsg.len,
-     &greyaddr, greyport)) return 0;
+     &greyaddr, greyport)) {
+    brk_report("greylist", 0, 0, 0);
+    return 0;
+  }
   
   /* don't wait very long */
   FD_ZERO(&fs);
   FD_SET(greysocket, &fs);
-  fst.tv_sec = 3; fst.tv_usec = 0;
+  fst.tv_sec = tmoms / 1000; fst.tv_usec = (tmoms % 1000) * 1000;
   r = select(greysocket+1, &fs, NULL, NULL, &fst);
+  gettimeofday(&end, NULL);
+  brk_report("greylist", r > 0, (end.tv_sec - start.tv_sec) * 1000
+	     + (end.tv_usec - start.tv_usec) / 1000, tmoms/2);
   if(r <= 0) { close(greysocket); greysocket = 0; return 0; }
 
   r = socket_recv4(greysocket, rbuf, sizeof rbuf, &raddr, &rport);
@@ -0,0 +1,123 @@
+/*
+ * Keep small messages in memory rather than in a scratch file on disk
+ *
+ * MEMSPOOLMAX: messages up to this size stay in memory, default 64k,
+ *   0 to leave them all on disk
+ *
+ * At data_start the spool file plugins and the backend are handed is
+ * replaced, under the same fd, by a memfd, with a copy of anything
+ * already in the file; if that's already past MEMSPOOLMAX the file is
+ * left alone.  If the message grows past MEMSPOOLMAX it's copied to a
+ * scratch file, which then takes the fd over, so only big messages
+ * touch the disk.  At message_end the memfd is sealed against changes,
+ * where the kernel can, as nothing should write the spool file after
+ * DATA (header changes go in the msgedit journal).
+ *
+ * List it before the other plugins that want the file, so its
+ * message_end seals the file before they look at it.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "mailfront.h"
+#include <msg/msg.h>
+
+#ifndef MFD_ALLOW_SEALING
+#define MFD_ALLOW_SEALING 0
+#endif
+
+static unsigned long memmax;
+static int spoolfd = -1;	/* fd that's a memfd, -1 if on disk */
+
+static const response* memspool_data_start(int fd)
+{
+  const char *s = session_getenv("MEMSPOOLMAX");
+  struct stat st;
+  off_t off = 0;
+  int mfd;
+
+  spoolfd = -1;
+  memmax = s ? strtoul(s, 0, 10) : 65536;
+  if(fd < 0 || !memmax) return 0;
+  if(fstat(fd, &st) != 0 || (unsigned long)st.st_size > memmax) return 0;
+
+  if((mfd = memfd_create("mailfront", MFD_CLOEXEC|MFD_ALLOW_SEALING)) < 0) {
+    if(errno != ENOSYS) msg1("memfd_create failed, spooling to disk");
+    return 0;
+  }
+  /* anything already written, say by an earlier plugin, comes along,
+     leaving the memfd's offset at the end like the file's */
+  while(off < st.st_size)
+    if(sendfile(mfd, fd, &off, st.st_size - off) <= 0) {
+      close(mfd);
+      return 0;
+    }
+  if(dup2(mfd, fd) < 0) {
+    close(mfd);
+    return 0;
+  }
+  close(mfd);
+  spoolfd = fd;
+  return 0;
+}
+
+/* too big for memory, move what we have to disk */
+static const response* memspool_spill(void)
+{
+  struct stat st;
+  off_t off = 0;
+  int dfd;
+
+  if(fstat(spoolfd, &st) != 0) return &resp_internal;
+  if((dfd = scratchfile()) == -1) return &resp_internal;
+  while(off < st.st_size)
+    if(sendfile(dfd, spoolfd, &off, st.st_size - off) <= 0) {
+      close(dfd);
+      return &resp_internal;
+    }
+  /* the rest of the message goes on the end */
+  if(dup2(dfd, spoolfd) < 0) {
+    close(dfd);
+    return &resp_internal;
+  }
+  close(dfd);
+  spoolfd = -1;
+  return 0;
+}
+
+static const response* memspool_data_block(const char* bytes, unsigned long len)
+{
+  struct stat st;
+
+  if(spoolfd < 0) return 0;
+  if(fstat(spoolfd, &st) != 0) return &resp_internal;
+  if((unsigned long)st.st_size + len > memmax) return memspool_spill();
+  return 0;
+  (void)bytes;
+}
+
+static const response* memspool_message_end(int fd)
+{
+  if(spoolfd < 0 || spoolfd != fd) return 0;
+#ifdef F_ADD_SEALS
+  fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK|F_SEAL_GROW|F_SEAL_WRITE|F_SEAL_SEAL);
+#endif
+  spoolfd = -1;
+  return 0;
+}
+
+struct plugin plugin = {
+  .version = PLUGIN_VERSION,
+  .flags = FLAG_NEED_FILE,
+  .data_start = memspool_data_start,
+  .data_block = memspool_data_block,
+  .message_end = memspool_message_end,
+};
@@ -1,26 +1,45 @@
 /*
  * Run the message through spamassassin via spamd
  * Socket name in SA_SOCKET, max message size to filter in SA_MAXSIZE
- * don't do it if in sump mode
+ * SA_TIMEOUT seconds to wait for spamd, default 30
+ * Skipped while the "spamd" breaker is open, see breaker.c
+ * don't do it if in sump mode, or for duplicates found by plugin-dedup
  * Take user name from session "username"
  * Optional list of nofilter users in control/nosafilter
+ * The header spamd sends back is compared with msghdr's index, and only
+ * the fields it added, changed or dropped go in the msgedit journal, the
+ * spool file isn't copied
+ * Needs backend-qmailsump or backend-spool, which apply the journal;
+ * with any other backend the message is refused rather than sent on
+ * without the edits
  */
 
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
 #include "mailfront.h"
 #include <net/socket.h>
 #include <iobuf/ibuf.h>
 #include <iobuf/obuf.h>
 #include <msg/msg.h>
-#include "conf_qmail.c"
-#include <dict/dict.h>
-#include <dict/load.h>
 
-static dict sanf;
-static str sasender;
+extern int ctl_lookup(const char *file, str *key);
+extern int brk_allow(const char *name);
+extern void brk_report(const char *name, int ok, unsigned long ms, unsigned long slowms);
+extern int med_check(void);
+extern int mh_parse(int fd);
+extern int mh_merge(const char *hdr, unsigned long len);
+extern int lf_crlf(const char *s, unsigned long len, struct iovec *iov, int maxiov,
+		   unsigned long *done);
+
+#define SAIOV 256
 
-static RESPONSE(no_chdir,451,"4.3.0 Could not change to the qmail directory.");
+static str sasender;
 
 /* remember the envelope */
 static const response* sa_sender(str* sender, str* param)
@@ -31,89 +50,142 @@ static const response* sa_sender(str* sender, str* param)
   (void)param;
 }
 
-/* now run it through spamd, and recopy to a new file */
+static unsigned long ms_since(const struct timeval *start)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (tv.tv_sec - start->tv_sec) * 1000
+    + (tv.tv_usec - start->tv_usec) / 1000;
+}
+
+/* all of iov to fd, waiting no more than tmoms each time */
+static int writev_all(int fd, struct iovec *iov, int n, unsigned long tmoms)
+{
+  struct pollfd pfd;
+  ssize_t w;
+
+  pfd.fd = fd;
+  pfd.events = POLLOUT;
+  while(n > 0) {
+    if(poll(&pfd, 1, tmoms) != 1) return 0;
+    if((w = writev(fd, iov, n)) < 0) {
+      if(errno == EINTR || errno == EAGAIN) continue;
+      return 0;
+    }
+    while(n > 0 && (size_t)w >= iov->iov_len) {
+      w -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if(n > 0) {
+      iov->iov_base = (char *)iov->iov_base + w;
+      iov->iov_len -= w;
+    }
+  }
+  return 1;
+}
+
+/* the message to spamd with CRLFs, straight from the mapped file */
+static int sa_send(int sockfd, int fd, unsigned long tmoms)
+{
+  struct iovec iov[SAIOV];
+  struct stat st;
+  unsigned long pos, done;
+  char *map;
+  int n, ok = 1;
+
+  if(fstat(fd, &st) != 0) return 0;
+  if(!st.st_size) return 1;
+  map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) return 0;
+  for(pos = 0; ok && pos < (unsigned long)st.st_size; pos += done) {
+    n = lf_crlf(map + pos, st.st_size - pos, iov, SAIOV, &done);
+    ok = writev_all(sockfd, iov, n, tmoms);
+  }
+  munmap(map, st.st_size);
+  return ok;
+}
+
+/* now run it through spamd, and note its header in place of ours */
 static const response* sa_message_end(int fd)
 {
   char *sockname = getenv("SA_SOCKET");
   char *sa_maxsize = getenv("SA_MAXSIZE");
   char *nosa = getenv("NOSPAMASSASSIN");
+  char *tmo = getenv("SA_TIMEOUT");
+  unsigned long tmoms = 1000 * (tmo ? atoi(tmo) : 30);
+  struct timeval start;
   int maxsize = 700000;
   const char *s;
-  const char* qh;
   int sockfd;
-  int newfd;
   obuf saob;
   ibuf saib;
-  ibuf msgib;
-  obuf newob;
-  unsigned bodystart = 0;
-  str msgstr;
+  static str msgstr;
+  static str newhdr;
 
   if(!sockname) return 0;
 
-  str_init(&msgstr);
-
   /* see if this is worth doing */
   if(nosa) {
     msg1("Skip spamassassin");
     return 0;			/* we already know about this, don't bother */
   }
   if(session_getnum("sump", 0)) return 0; /* known spam, don't bother */
+  if(session_getnum("dupmsg", 0)) return 0; /* scanned the first copy */
 
   if(sa_maxsize) maxsize = atoi(sa_maxsize);
   if(lseek(fd, 0, SEEK_CUR) > maxsize) return 0; /* too big */
 
   s = session_getstr("username");
   if(s) {
-    if ((qh = getenv("QMAILHOME")) == 0)
-      qh = conf_qmail;
-    if (chdir(qh) == -1) return &resp_no_chdir;
-    if (!dict_load_list(&sanf, "control/nosafilter", 0, 0))
-      return &resp_internal;
+    int nf;
+
     str_copys(&msgstr, s);
-    if(dict_get(&sanf, &msgstr)) {
+    if((nf = ctl_lookup("control/nosafilter", &msgstr)) < 0)
+      return &resp_internal;
+    if(nf) {
       msg2("no sa for ", s);
       return 0; /* don't do sa for this user */
     }
   }
 
-  if((newfd = scratchfile()) == -1) return &resp_internal;
-  obuf_init(&newob, newfd, 0, 0, 0);
+  if(!mh_parse(fd) || !med_check()) return &resp_internal;
+  if(!brk_allow("spamd")) {
+    msg1("spamd breaker open, skipping");
+    session_setnum("scanskip", 1);
+    return 0;
+  }
+  gettimeofday(&start, NULL);
 
   if(!(sockfd = socket_unixstr())) return 0;
-  if(!socket_connectu(sockfd, sockname)) return 0;
+  if(!socket_connectu(sockfd, sockname)) {
+    brk_report("spamd", 0, 0, 0);
+    return 0;
+  }
   obuf_init(&saob, sockfd, 0, 0, 0);
+  saob.io.timeout = tmoms;
 
   /* now send the control header */
-  if(!obuf_puts(&saob, "HEADERS SPAMC/1.4\r\n")) return &resp_internal;
-  if(s && !obuf_put3s(&saob, "User: ", s, "\r\n")) return &resp_internal;
-  if(!obuf_puts(&saob, "\r\n")) return &resp_internal;
+  if(!obuf_puts(&saob, "HEADERS SPAMC/1.4\r\n")) goto failed;
+  if(s && !obuf_put3s(&saob, "User: ", s, "\r\n")) goto failed;
+  if(!obuf_puts(&saob, "\r\n")) goto failed;
 
   /* send it a return path for a hint about the sender */
-  if(!obuf_put3s(&saob, "Return-Path: <", sasender.s, ">\r\n")) return &resp_internal;
+  if(!obuf_put3s(&saob, "Return-Path: <", sasender.s, ">\r\n")) goto failed;
 
-  /* can't use ibuf_rewind, it thinks it's already there */
-  if (lseek(fd, 0, SEEK_SET) != 0) return &resp_internal;
-  ibuf_init(&msgib, fd, 0, 0, 0);
-
-  /* copy msg to sa, remember where the body started */
-  while(ibuf_getstr(&msgib, &msgstr, LF)) {
-    if(!bodystart) { /* in header */
-      if(msgstr.s[0] == LF) bodystart = ibuf_tell(&msgib);
-    }
-    /* LF -> CRLF */
-    if(!obuf_write(&saob, msgstr.s, msgstr.len-1)
-       || !obuf_write(&saob, "\r\n", 2)) return &resp_internal;
-  }
-  obuf_flush(&saob);
+  /* then the message, without copying it line by line */
+  if(!obuf_flush(&saob)) goto failed;
+  if(!sa_send(sockfd, fd, tmoms)) goto failed;
 
   /* shutdown output and see what happened */
   socket_shutdown(sockfd, 0, 1);
   ibuf_init(&saib, sockfd, 0, 0, 0);
+  saib.io.timeout = tmoms;
 
   /* summary */
-  if(!ibuf_getstr_crlf(&saib, &msgstr)) return &resp_internal;
-  if(!str_globs(&msgstr, "SPAMD*EX_OK")) return &resp_internal;
+  if(!ibuf_getstr_crlf(&saib, &msgstr)) goto failed;
+  if(!str_globs(&msgstr, "SPAMD*EX_OK")) goto failed;
 
   /* loop over status lines */
   while(ibuf_getstr_crlf(&saib, &msgstr)) {
@@ -125,29 +197,35 @@ static const response* sa_message_end(int fd)
     }
   }
 
+  str_truncate(&newhdr, 0);
+
   /* throw away our return-path, qmail will add its own */
   if(ibuf_getstr_crlf(&saib, &msgstr) &&
      !str_starts(&msgstr, "Return-Path:")) {
-    if(!obuf_putstr(&newob, &msgstr)
-       || !obuf_putc(&newob, LF)) return &resp_internal;
+    if(!str_cat(&newhdr, &msgstr)
+       || !str_catc(&newhdr, LF)) return &resp_oom;
   }
 
-  /* copy new header to new msg */
+  /* collect the new header */
   while(ibuf_getstr_crlf(&saib, &msgstr)) {
-    if(!obuf_putstr(&newob, &msgstr)
-       || !obuf_putc(&newob, LF)) return &resp_internal;
+    if(!str_cat(&newhdr, &msgstr)
+       || !str_catc(&newhdr, LF)) return &resp_oom;
   }
 
-  if(bodystart) {
-    ibuf_seek(&msgib, bodystart);
-    if(!iobuf_copy(&msgib, &newob)) return &resp_internal;
-  }
-  obuf_flush(&newob);
+  if(!ibuf_eof(&saib)) goto failed; /* timed out partway through */
+  brk_report("spamd", 1, ms_since(&start), tmoms/2);
+  close(sockfd);
+
+  /* only the fields spamd added, changed or dropped, so other
+     plugins' edits to the rest of our header stand */
+  if(!mh_merge(newhdr.s, newhdr.len)) return &resp_oom;
 
-  /* now replace the temp file */
-  dup2(newfd, fd);
-  close(newfd);
+  return 0;
 
+ failed:			/* spamd didn't answer, carry on without it */
+  msg1("spamd failed or timed out");
+  close(sockfd);
+  brk_report("spamd", 0, ms_since(&start), tmoms/2);
   return 0;
 }
 
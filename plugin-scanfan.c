@@ -0,0 +1,462 @@
+/*
+ * Run the message through DCC and spamassassin at the same time
+ * Use instead of plugin-dcc and plugin-sauser, not with them
+ *
+ * DCC socket name in DCC_SOCKET, spamd socket name in SA_SOCKET
+ * either may be missing to skip that scanner
+ * max message size for SA in SA_MAXSIZE, NOSPAMASSASSIN to skip SA
+ * DCC_TIMEOUT and SA_TIMEOUT seconds to wait for each,
+ * default SCAN_TIMEOUT or 30
+ * Either is skipped while its "dcc" or "spamd" breaker is open,
+ * see breaker.c
+ * Neither is run for duplicates found by plugin-dedup
+ * Take user name from session "username"
+ * Optional list of nofilter users in control/nosafilter
+ *
+ * The spool file is read once and fed to both daemons as it's read,
+ * the header from msghdr's index, then both sets of header changes go
+ * in the msgedit journal, the spool file isn't copied
+ * Needs backend-qmailsump or backend-spool, which apply the journal;
+ * with any other backend the message is refused rather than sent on
+ * without the edits
+ */
+
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include "mailfront.h"
+#include <net/socket.h>
+#include <msg/msg.h>
+
+extern int ctl_lookup(const char *file, str *key);
+extern int brk_allow(const char *name);
+extern void brk_report(const char *name, int ok, unsigned long ms, unsigned long slowms);
+extern int med_insert(off_t off, const char *text, unsigned long len);
+extern int med_delete(off_t off, off_t len);
+extern int med_check(void);
+extern int mh_parse(int fd);
+extern int mh_count(void);
+extern off_t mh_end(void);
+extern off_t mh_body(void);
+extern int mh_prefix(const char *prefix, int prev);
+extern const char* mh_field(int i, off_t *off, unsigned long *len);
+extern int mh_merge(const char *hdr, unsigned long len);
+extern int lf_crlf(const char *s, unsigned long len, struct iovec *iov, int maxiov,
+		   unsigned long *done);
+
+#define SCANFLUSH 65536		/* pump the sockets past this much */
+
+struct scanner {
+  const char *name;
+  int fd;			/* socket, -1 if not running */
+  int shut;			/* output shut down */
+  int eof;			/* all of the response is in */
+  struct timeval deadline;
+  unsigned long tmoms;
+  str out;			/* request not yet sent */
+  unsigned long outpos;
+  str in;			/* response so far */
+};
+
+static struct scanner dcc = { .name = "dcc", .fd = -1 };
+static struct scanner sa = { .name = "spamd", .fd = -1 };
+
+static str scsender;
+static str dccrecips;
+
+/* remember the envelope */
+static const response* scan_sender(str* sender, str* param)
+{
+  if(!str_copy(&scsender, sender)) return &resp_oom;
+  str_truncate(&dccrecips, 0);
+
+  return 0;
+  (void)param;
+}
+
+static const response* scan_recipient(str* recipient, str* param)
+{
+  const char *s = 0;
+
+  if(!dccrecips.len) {		/* first one */
+    s = session_getstr("username");
+  }
+  if(!str_cats(&dccrecips, recipient->s)) return &resp_oom;
+  if(s && !str_cat2s(&dccrecips, "\r", s)) return &resp_oom;
+  if(!str_catc(&dccrecips, LF)) return &resp_oom;
+
+  return 0;
+  (void)param;
+}
+
+static void scan_close(struct scanner *sc)
+{
+  if(sc->fd >= 0) close(sc->fd);
+  sc->fd = -1;
+}
+
+static long ms_left(const struct timeval *deadline)
+{
+  struct timeval tv;
+
+  gettimeofday(&tv, NULL);
+  return (deadline->tv_sec - tv.tv_sec) * 1000
+    + (deadline->tv_usec - tv.tv_usec) / 1000;
+}
+
+static int scan_open(struct scanner *sc, const char *sockname, const char *tmo)
+{
+  sc->shut = sc->eof = 0;
+  sc->outpos = 0;
+  str_truncate(&sc->out, 0);
+  str_truncate(&sc->in, 0);
+
+  if(!brk_allow(sc->name)) {
+    msg3(sc->name, " breaker open", ", skipping");
+    session_setnum("scanskip", 1);
+    return 0;
+  }
+  if(!tmo) tmo = getenv("SCAN_TIMEOUT");
+  sc->tmoms = 1000 * (tmo ? atoi(tmo) : 30);
+  gettimeofday(&sc->deadline, NULL);
+  sc->deadline.tv_sec += sc->tmoms / 1000;
+
+  if((sc->fd = socket_unixstr()) < 0) return 0;
+  if(!socket_connectu(sc->fd, sockname)
+     || fcntl(sc->fd, F_SETFL, fcntl(sc->fd, F_GETFL, 0) | O_NONBLOCK) == -1) {
+    msg3("can't connect to ", sc->name, " daemon");
+    scan_close(sc);
+    brk_report(sc->name, 0, 0, 0);
+    return 0;
+  }
+  return 1;
+}
+
+/* tell the breaker how it went */
+static void scan_report(struct scanner *sc)
+{
+  brk_report(sc->name, sc->eof, sc->tmoms - ms_left(&sc->deadline), sc->tmoms/2);
+}
+
+/* move data to and from the daemons
+ * until there's no more than limit bytes waiting to go out
+ * and if final, until both responses are complete
+ */
+static void scan_pump(struct scanner **scs, int nsc, unsigned long limit,
+		      int final)
+{
+  struct pollfd pfd[2];
+  char rbuf[4096];
+  int i, n;
+
+  for(;;) {
+    int busy = 0;
+    long wait = -1;
+
+    for(i = 0; i < nsc; i++) {
+      struct scanner *sc = scs[i];
+      long left;
+
+      pfd[i].fd = -1;
+      pfd[i].events = 0;
+      if(sc->fd < 0) continue;
+      if((left = ms_left(&sc->deadline)) <= 0) {
+	msg3(sc->name, " daemon", " timed out");
+	scan_close(sc);
+	continue;
+      }
+      if(wait < 0 || left < wait) wait = left;
+      if(final && sc->out.len == sc->outpos && !sc->shut) {
+	socket_shutdown(sc->fd, 0, 1);
+	sc->shut = 1;
+      }
+      if(sc->out.len - sc->outpos > limit) busy = 1;
+      if(final && !sc->eof) busy = 1;
+      pfd[i].fd = sc->fd;
+      pfd[i].events = POLLIN;
+      if(sc->out.len > sc->outpos) pfd[i].events |= POLLOUT;
+    }
+    if(!busy) return;
+
+    if((n = poll(pfd, nsc, wait)) == 0) continue; /* someone timed out */
+    if(n < 0) {
+      if(errno == EINTR) continue;
+      return;
+    }
+
+    for(i = 0; i < nsc; i++) {
+      struct scanner *sc = scs[i];
+
+      if(pfd[i].fd < 0 || !pfd[i].revents) continue;
+      if(pfd[i].revents & POLLOUT) {
+	n = write(sc->fd, sc->out.s + sc->outpos, sc->out.len - sc->outpos);
+	if(n < 0 && errno != EAGAIN && errno != EINTR) {
+	  scan_close(sc);
+	  continue;
+	}
+	if(n > 0) sc->outpos += n;
+	if(sc->outpos == sc->out.len) {
+	  str_truncate(&sc->out, 0);
+	  sc->outpos = 0;
+	}
+      }
+      if(pfd[i].revents & (POLLIN|POLLHUP|POLLERR)) {
+	n = read(sc->fd, rbuf, sizeof rbuf);
+	if(n < 0 && errno != EAGAIN && errno != EINTR) {
+	  scan_close(sc);
+	  continue;
+	}
+	if(n == 0) {
+	  sc->eof = 1;
+	  scan_close(sc);
+	  continue;
+	}
+	if(n > 0 && !str_catb(&sc->in, rbuf, n)) scan_close(sc);
+      }
+    }
+
+    /* don't let the buffers creep up */
+    for(i = 0; i < nsc; i++) {
+      struct scanner *sc = scs[i];
+
+      if(sc->outpos > SCANFLUSH) {
+	memmove(sc->out.s, sc->out.s + sc->outpos, sc->out.len - sc->outpos);
+	str_truncate(&sc->out, sc->out.len - sc->outpos);
+	sc->outpos = 0;
+      }
+    }
+  }
+}
+
+/* get the next line from a response, without the line ending */
+static int scan_line(str *in, unsigned *pos, const char **line, unsigned *len)
+{
+  unsigned i;
+
+  if(*pos >= in->len) return 0;
+  for(i = *pos; i < in->len && in->s[i] != LF; i++)
+    ;
+  *line = in->s + *pos;
+  *len = i - *pos;
+  if(*len && (*line)[*len-1] == '\r') --*len;
+  *pos = i + 1;
+  return 1;
+}
+
+/* LF -> CRLF for spamd */
+static int crlf_cat(str *out, const char *s, unsigned long len)
+{
+  struct iovec iov[64];
+  unsigned long done;
+  int i, n;
+
+  while(len > 0) {
+    n = lf_crlf(s, len, iov, 64, &done);
+    for(i = 0; i < n; i++)
+      if(!str_catb(out, iov[i].iov_base, iov[i].iov_len)) return 0;
+    s += done;
+    len -= done;
+  }
+  return 1;
+}
+
+/* now run it through both, and note the header changes */
+static const response* scan_message_end(int fd)
+{
+  char *dccsock = getenv("DCC_SOCKET");
+  char *sasock = getenv("SA_SOCKET");
+  char *sa_maxsize = getenv("SA_MAXSIZE");
+  int maxsize = 700000;
+  int sump = session_getnum("sump", 0);
+  const char *s;
+  const char *user;
+  struct scanner *scs[2];
+  int nsc = 0;
+  unsigned pos, len;
+  off_t off;
+  unsigned long flen;
+  int i, x;
+  const char *line;
+  const char *dccline = 0;	/* new X-DCC header */
+  unsigned dccllen = 0;
+  unsigned sahdr = 0;		/* offset of new header from spamd */
+  static str newhdr;
+  struct stat st;
+  char *map;
+  static str msgstr;
+
+  if(session_getnum("dupmsg", 0)) return 0; /* scanned the first copy */
+  if(!mh_parse(fd) || !med_check()) return &resp_internal;
+
+  user = session_getstr("username");
+  dcc.eof = sa.eof = 0;
+
+  if(dccsock && scan_open(&dcc, dccsock, getenv("DCC_TIMEOUT"))) scs[nsc++] = &dcc;
+
+  /* see if SA is worth doing */
+  if(sasock && getenv("NOSPAMASSASSIN")) {
+    msg1("Skip spamassassin");
+    sasock = 0;
+  }
+  if(sump) sasock = 0;		/* known spam, don't bother */
+  if(sa_maxsize) maxsize = atoi(sa_maxsize);
+  if(sasock && lseek(fd, 0, SEEK_CUR) > maxsize) sasock = 0; /* too big */
+  if(sasock && user) {
+    int nf;
+
+    str_copys(&msgstr, user);
+    if((nf = ctl_lookup("control/nosafilter", &msgstr)) < 0)
+      return &resp_internal;
+    if(nf) {
+      msg2("no sa for ", user);
+      sasock = 0;		/* don't do sa for this user */
+    }
+  }
+  if(sasock && scan_open(&sa, sasock, getenv("SA_TIMEOUT"))) scs[nsc++] = &sa;
+
+  if(!nsc) return 0;
+
+  /* DCC header */
+  if(dcc.fd >= 0) {
+    if(sump) str_cats(&dcc.out, "spam ");
+    str_cats(&dcc.out, "header\n");
+
+    /* client */
+    str_cat4s(&dcc.out, getprotoenv("REMOTEIP"), "\r", getprotoenv("REMOTEHOST"), "\n");
+
+    /* HELO or null */
+    s = session_getstr("helo_domain");
+    if(s) str_cats(&dcc.out, s);
+    str_catc(&dcc.out, LF);
+
+    /* sender, recipients */
+    str_cat(&dcc.out, &scsender);
+    str_catc(&dcc.out, LF);
+    str_cat(&dcc.out, &dccrecips);
+    if(!str_catc(&dcc.out, LF)) return &resp_oom;
+  }
+
+  /* SA control header, and a return path for a hint about the sender */
+  if(sa.fd >= 0) {
+    str_cats(&sa.out, "HEADERS SPAMC/1.4\r\n");
+    if(user) str_cat3s(&sa.out, "User: ", user, "\r\n");
+    str_cats(&sa.out, "\r\n");
+    if(!str_cat3s(&sa.out, "Return-Path: <", scsender.s, ">\r\n")) return &resp_oom;
+  }
+
+  /* one pass over the message feeds both, the header from the index,
+     DCC doesn't get old X-DCC fields */
+  x = mh_prefix("X-DCC-", -1);
+  for(i = 0; i < mh_count(); i++) {
+    line = mh_field(i, &off, &flen);
+    if(i == x)
+      x = mh_prefix("X-DCC-", i);
+    else if(dcc.fd >= 0 && !str_catb(&dcc.out, line, flen)) return &resp_oom;
+    if(sa.fd >= 0 && !crlf_cat(&sa.out, line, flen)) return &resp_oom;
+    if(dcc.out.len - dcc.outpos > SCANFLUSH || sa.out.len - sa.outpos > SCANFLUSH)
+      scan_pump(scs, nsc, SCANFLUSH, 0);
+  }
+
+  /* and the rest from the file, a block at a time */
+  if(fstat(fd, &st) != 0) return &resp_internal;
+  if(st.st_size > mh_end()) {
+    map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if(map == MAP_FAILED) return &resp_internal;
+    for(off = mh_end(); off < st.st_size; off += flen) {
+      flen = st.st_size - off < SCANFLUSH ? st.st_size - off : SCANFLUSH;
+      if((dcc.fd >= 0 && !str_catb(&dcc.out, map + off, flen))
+	 || (sa.fd >= 0 && !crlf_cat(&sa.out, map + off, flen))) {
+	munmap(map, st.st_size);
+	return &resp_oom;
+      }
+      scan_pump(scs, nsc, SCANFLUSH, 0);
+    }
+    munmap(map, st.st_size);
+  }
+
+  /* send the rest and wait for both to answer */
+  scan_pump(scs, nsc, 0, 1);
+  for(pos = 0; pos < (unsigned)nsc; pos++) scan_report(scs[pos]);
+
+  /* summary, per recipient, new X-DCC line */
+  if(dcc.eof) {
+    pos = 0;
+    if(scan_line(&dcc.in, &pos, &line, &len)) {
+      str_copyb(&msgstr, line, len);
+      msg2("dcc said ", msgstr.s);
+      if(!scan_line(&dcc.in, &pos, &line, &len)
+	 || !scan_line(&dcc.in, &pos, &dccline, &dccllen)) dccline = 0;
+    }
+    if(!dccline) msg1("dcc response incomplete");
+  }
+
+  /* status line, status lines up to a blank, then the new header */
+  if(sa.eof) {
+    pos = 0;
+    str_copys(&msgstr, "");
+    if(scan_line(&sa.in, &pos, &line, &len)) str_copyb(&msgstr, line, len);
+    if(str_globs(&msgstr, "SPAMD*EX_OK")) {
+      while(scan_line(&sa.in, &pos, &line, &len) && len) {
+	if(len >= 5 && !memcmp(line, "Spam:", 5)) {
+	  str_copyb(&msgstr, line, len);
+	  msg2("sa said ", msgstr.s);
+	}
+      }
+      sahdr = pos;
+    } else
+      msg1("sa response not OK");
+  }
+
+  if(sump) return 0;	     /* no new info if we said spam, no rewrite */
+  if(!dccline && !sahdr) return 0;
+
+  if(sahdr) {
+    /* what spamd changed in our header, less our return-path; old
+       X-DCC left out if there's a new one, so they're dropped */
+    int first = 1;
+
+    str_truncate(&newhdr, 0);
+    pos = sahdr;
+    while(scan_line(&sa.in, &pos, &line, &len) && len) {
+      if(first && len >= 12 && !memcmp(line, "Return-Path:", 12)) {
+	first = 0;
+	continue;
+      }
+      first = 0;
+      if(dccline && len >= 6 && !memcmp(line, "X-DCC-", 6)) continue;
+      if(!str_catb(&newhdr, line, len) || !str_catc(&newhdr, LF))
+	return &resp_oom;
+    }
+    if(!mh_merge(newhdr.s, newhdr.len)) return &resp_oom;
+  } else {
+    /* our header, less old X-DCC */
+    for(i = mh_prefix("X-DCC-", -1); i >= 0; i = mh_prefix("X-DCC-", i)) {
+      mh_field(i, &off, &flen);
+      if(!med_delete(off, flen)) return &resp_oom;
+    }
+  }
+
+  /* new X-DCC at the end of the header, and a blank line if there
+     wasn't one */
+  str_truncate(&newhdr, 0);
+  if(dccline && (!str_catb(&newhdr, dccline, dccllen)
+		 || !str_catc(&newhdr, LF))) return &resp_oom;
+  if(mh_body() == mh_end() && !str_catc(&newhdr, LF)) return &resp_oom;
+  if(!med_insert(mh_end(), newhdr.s, newhdr.len)) return &resp_oom;
+
+  return 0;
+}
+
+struct plugin plugin = {
+  .version = PLUGIN_VERSION,
+  .flags = FLAG_NEED_FILE,
+  .sender = scan_sender,
+  .recipient = scan_recipient,
+  .message_end = scan_message_end,
+};
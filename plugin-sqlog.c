@@ -14,7 +14,7 @@ CREATE TABLE mail (
   sourceip int(10) unsigned DEFAULT NULL,
   sourceip6 binary(16) DEFAULT NULL,
   spamserial int(7) unsigned DEFAULT NULL,
-  flags set('greylist','sump','spam','virus','badabuse','badrcpt','badbatv','dnsbl','dblhelo','dblfrom') NOT NULL,
+  flags set('greylist','sump','spam','virus','badabuse','badrcpt','badbatv','dnsbl','dblhelo','dblfrom','scanskip') NOT NULL,
   mailfrom varchar(255) NOT NULL,
   envdomain varchar(255) DEFAULT NULL,
   PRIMARY KEY (serial),
@@ -83,7 +83,7 @@ static const response* sq_sender(str* sender, str* params)
   if(r) return r;		/* seq error */
 
   str_copy(&qsender, sender);
-  str_init(&qrecips);
+  str_truncate(&qrecips, 0);
 
   return 0;
   (void)params;
@@ -178,9 +178,8 @@ static const response* sq_init(void)
 
 static const response* get_seq(void)
 {
-  str sql;
+  static str sql;
 
-  str_init(&sql);
   /* do IPv6 differently */
   if(strchr(remote_ip, ':')) {
     if(!str_copy5s(&sql,
@@ -199,7 +198,7 @@ static const response* get_seq(void)
   }
   
   if(!sqlquery(&sql, &sqlseq)
-     || !str_init(&sqlseqstr)
+     || !str_copys(&sqlseqstr, "")
      || !str_catu(&sqlseqstr, sqlseq)) return &resp_internal;
   
   msg2("assigned seq ",sqlseqstr.s);
@@ -239,16 +238,13 @@ static void addflag(const char *var, const char* flag, int reset)
 /* actually do the log entry */
 static void dosqlog(void)
 {
-  str sql;
-  str mq, mr, md;
+  static str sql;
+  static str mq, mr, md;
   unsigned int i, ni;
 
   if(!sqlseq) return;		/* nothing happened */
 
-  str_init(&sql);
-  str_init(&mq);
-  str_init(&mr);
-  str_init(&mflags);
+  str_truncate(&mflags, 0);
   addflag("greylist", "greylist", 1);
   addflag("sump", "sump", 0);
   addflag("dblhelo", "dblhelo", 0);
@@ -256,6 +252,7 @@ static void dosqlog(void)
   addflag("badrcpt", "badrcpt", 1);
   addflag("badbatv", "badbatv", 1);
   addflag("rcptrule", "badabuse", 1);
+  addflag("scanskip", "scanskip", 1);
 
   str_copys(&sql, "update mail set flags='");
   str_cat(&sql, &mflags);
@@ -265,7 +262,6 @@ static void dosqlog(void)
   /* envelope domain */
   i = str_findfirst(&qsender, '@');
   if(i < qsender.len) {
-    str_init(&md);
     str_copyb(&md, qsender.s+i+1, qsender.len-i-1);
     sqlquote(&md, &mq);
     str_cats(&sql, "',envdomain='");
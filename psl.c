@@ -0,0 +1,247 @@
+/*
+ * Public suffix lookups for DMARC, from the trie pslcomp makes
+ * Separate module so every plugin shares one copy per process
+ *
+ * The trie is control/effective_tld_names.psl under QMAILHOME, mapped
+ * read-only so all processes share one copy.  It's stat'ed at most once
+ * a second and remapped when pslcomp replaces it.
+ *
+ * psl_available() -> 1 if there's a trie to use, 0 if not
+ * psl_orgdomain(const char *domain, str *org)
+ *  -> 1 with the organizational domain in org, 0 if domain is a public
+ *     suffix itself, -1 for error
+ * psl_align(const char *dom, const char *fromdom, int strict)
+ *  -> fromdom if dom is aligned with it, else dom, so opendmarc can
+ *     check alignment without its own copy of the list
+ * psl_dmarc_record(const char *domain, str *rec, str *recdom)
+ *  -> 1 with the DMARC record for domain in rec, falling back to its
+ *     organizational domain, and the domain it came from in recdom,
+ *     0 if there's none, -1 for DNS trouble
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include "conf_qmail.c"
+
+#define PSLMAGIC "mfpsl01"
+
+#define PSL_RULE 1
+#define PSL_WILD 2
+#define PSL_EXCEPT 4
+
+/* same as pslcomp */
+struct pslhdr {
+  char magic[8];
+  uint32_t nnodes;
+  uint32_t poolsize;
+};
+
+struct pslnode {
+  uint32_t label;
+  uint32_t first;
+  uint16_t nkids;
+  uint8_t len;
+  uint8_t flags;
+};
+
+static str pslpath;
+static const char *pslmap;
+static size_t psllen;
+static const struct pslnode *pslnodes;
+static const char *pslpool;
+static struct stat pslst;
+static time_t pslchecked;
+
+static void psl_unmap(void)
+{
+  if(pslmap) munmap((void *)pslmap, psllen);
+  pslmap = 0;
+  pslnodes = 0;
+}
+
+static int psl_map(void)
+{
+  const struct pslhdr *h;
+  struct stat st;
+  time_t now = time(0);
+  void *m;
+  int fd;
+
+  if(pslmap && now == pslchecked) return 1;
+  pslchecked = now;
+  if(!pslpath.len) {
+    const char *qh;
+
+    if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+    if(!str_copy2s(&pslpath, qh, "/control/effective_tld_names.psl")) return 0;
+  }
+  if(stat(pslpath.s, &st) != 0) {
+    psl_unmap();
+    return 0;
+  }
+  if(pslmap && st.st_ino == pslst.st_ino && st.st_dev == pslst.st_dev
+     && st.st_mtime == pslst.st_mtime)
+    return 1;
+
+  /* new or replaced */
+  psl_unmap();
+  if((fd = open(pslpath.s, O_RDONLY)) < 0) return 0;
+  if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *h) {
+    close(fd);
+    return 0;
+  }
+  m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) return 0;
+  h = m;
+  if(memcmp(h->magic, PSLMAGIC, 8) || h->nnodes == 0
+     || sizeof *h + (size_t)h->nnodes*sizeof *pslnodes + h->poolsize > (size_t)st.st_size) {
+    msg2("bad public suffix trie ", pslpath.s);
+    munmap(m, st.st_size);
+    return 0;
+  }
+  pslmap = m;
+  psllen = st.st_size;
+  pslnodes = (const struct pslnode *)(pslmap + sizeof *h);
+  pslpool = (const char *)(pslnodes + h->nnodes);
+  pslst = st;
+  return 1;
+}
+
+int psl_available(void)
+{
+  return psl_map();
+}
+
+static const struct pslnode* psl_child(const struct pslnode *n, const char *label, unsigned len)
+{
+  unsigned lo = 0, hi = n->nkids;
+
+  while(lo < hi) {
+    unsigned mid = (lo + hi) / 2;
+    const struct pslnode *k = &pslnodes[n->first + mid];
+    int c = memcmp(pslpool + k->label, label, k->len < len ? k->len : len);
+
+    if(!c) c = (int)k->len - (int)len;
+    if(!c) return k;
+    if(c < 0) lo = mid + 1;
+    else hi = mid;
+  }
+  return 0;
+}
+
+int psl_orgdomain(const char *domain, str *org)
+{
+  static str dom;
+  const struct pslnode *n;
+  const struct pslnode *k;
+  unsigned labels[128];	/* start of each label, right to left */
+  unsigned nlabels = 0;
+  unsigned suffix = 1;	/* labels in the public suffix, "*" rule */
+  unsigned end, i;
+
+  if(!psl_map()) return -1;
+  if(!str_copys(&dom, domain)) return -1;
+  if(dom.len && dom.s[dom.len-1] == '.') str_truncate(&dom, dom.len-1);
+  for(i = 0; i < dom.len; i++) dom.s[i] = tolower((unsigned char)dom.s[i]);
+
+  for(end = dom.len; nlabels < 128; ) {
+    for(i = end; i > 0 && dom.s[i-1] != '.'; i--)
+      ;
+    if(i == end) return 0;	/* empty label */
+    labels[nlabels++] = i;
+    if(i == 0) break;
+    end = i - 1;
+  }
+
+  /* longest match wins, except that an exception beats everything */
+  n = &pslnodes[0];
+  for(i = 0; i < nlabels; i++) {
+    unsigned start = labels[i];
+    unsigned len = (i ? labels[i-1] - 1 : dom.len) - start;
+
+    if(n->flags & PSL_WILD) suffix = i + 1;
+    if((k = psl_child(n, dom.s + start, len)) == 0) break;
+    if(k->flags & PSL_EXCEPT) {
+      suffix = i;
+      break;
+    }
+    if(k->flags & PSL_RULE) suffix = i + 1;
+    n = k;
+  }
+
+  if(nlabels <= suffix) return 0;
+  return str_copys(org, dom.s + labels[suffix]) ? 1 : -1;
+}
+
+const char* psl_align(const char *dom, const char *fromdom, int strict)
+{
+  static str a, b;
+
+  if(!dom || !fromdom) return dom;
+  if(!strcasecmp(dom, fromdom)) return fromdom;
+  if(strict) return dom;
+  if(psl_orgdomain(dom, &a) == 1 && psl_orgdomain(fromdom, &b) == 1
+     && !str_diff(&a, &b))
+    return fromdom;
+  return dom;
+}
+
+/* TXT record starting v=DMARC1, 1 found, 0 none, -1 trouble */
+static int dmarc_txt(const char *domain, str *rec)
+{
+  static str qname;
+  unsigned char ans[4096];
+  ns_msg msg;
+  ns_rr rr;
+  int len, i;
+
+  if(!str_copy2s(&qname, "_dmarc.", domain)) return -1;
+  len = res_query(qname.s, C_IN, T_TXT, ans, sizeof ans);
+  if(len < 0)
+    return (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA) ? 0 : -1;
+  if(ns_initparse(ans, len, &msg) < 0) return -1;
+
+  for(i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    const unsigned char *p, *e;
+
+    if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) return -1;
+    if(ns_rr_type(rr) != T_TXT) continue;
+    /* glue the strings together */
+    str_truncate(rec, 0);
+    for(p = ns_rr_rdata(rr), e = p + ns_rr_rdlen(rr); p < e; p += 1 + *p) {
+      if(p + 1 + *p > e) break;
+      if(!str_catb(rec, (const char *)p+1, *p)) return -1;
+    }
+    if(str_case_starts(rec, "v=DMARC1")) return 1;
+  }
+  return 0;
+}
+
+int psl_dmarc_record(const char *domain, str *rec, str *recdom)
+{
+  static str org;
+  int r;
+
+  if((r = dmarc_txt(domain, rec)) != 0) {
+    if(r > 0 && !str_copys(recdom, domain)) return -1;
+    return r;
+  }
+  if(psl_orgdomain(domain, &org) != 1 || !strcasecmp(org.s, domain)) return 0;
+  if((r = dmarc_txt(org.s, rec)) > 0 && !str_copy(recdom, &org)) return -1;
+  return r;
+}
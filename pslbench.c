@@ -0,0 +1,69 @@
+/*
+ * Time organizational domain lookups in the trie pslcomp makes, as
+ * authres and arlog do them through psl.so
+ *
+ * usage: pslbench domains [rounds]
+ * domains is a file of names, one a line; rounds defaults to 100.
+ * The trie is control/effective_tld_names.psl under QMAILHOME, as in
+ * psl.c.  Prints lookups a second, the size of the mapped trie, which
+ * every process shares, and this process's peak RSS.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <iobuf/ibuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include "psl.c"
+
+const char program[] = "pslbench";
+const int msg_show_pid = 0;
+
+static double secs_since(const struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+int main(int argc, char *argv[])
+{
+  static str names, line, org;
+  struct timeval start;
+  struct rusage ru;
+  ibuf in;
+  const char *s;
+  unsigned long n = 0, orgs = 0;
+  double secs;
+  int i;
+  int rounds = argc > 2 ? atoi(argv[2]) : 100;
+
+  if(argc < 2) die1(1, "usage: pslbench domains [rounds]");
+  if(!ibuf_open(&in, argv[1], 0)) die2sys(1, "can't open ", argv[1]);
+  /* NUL separated, so the loop doesn't copy them */
+  while(ibuf_getstr(&in, &line, '\n')) {
+    str_rstrip(&line);
+    if(!line.len) continue;
+    if(!str_catb(&names, line.s, line.len + 1)) die1(1, "out of memory");
+    n++;
+  }
+  ibuf_close(&in);
+  if(!n) die2(1, "no names in ", argv[1]);
+  if(!psl_available()) die1(1, "no public suffix trie, run pslcomp");
+
+  gettimeofday(&start, NULL);
+  for(i = 0; i < rounds; i++)
+    for(s = names.s; s < names.s + names.len; s += strlen(s) + 1)
+      if(psl_orgdomain(s, &org) > 0) orgs++;
+  secs = secs_since(&start);
+
+  getrusage(RUSAGE_SELF, &ru);
+  printf("%lu names, %lu with an organizational domain\n", n, orgs / rounds);
+  printf("%.0f lookups/s, trie %lu bytes shared, peak RSS %ld kB\n",
+	 secs > 0 ? n * rounds / secs : 0, (unsigned long)psllen, ru.ru_maxrss);
+  return 0;
+}
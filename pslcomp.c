@@ -0,0 +1,210 @@
+/*
+ * Compile the public suffix list into the trie psl.c maps
+ *
+ * usage: pslcomp [source [output]]
+ * default control/effective_tld_names.dat to
+ * control/effective_tld_names.psl, relative to QMAILHOME
+ *
+ * The output is written to a temporary file and renamed into place,
+ * so running processes see either the old trie or the new one and
+ * pick up the new one within a second.
+ *
+ * Format: header, nodes, label strings.  Node 0 is the root, and
+ * each node's children are contiguous and sorted by label so lookups
+ * can binary search them.  Labels are stored reversed from the domain,
+ * so "co.uk" is uk -> co.  A "*.x" rule is a flag on x, an "!x.y" rule
+ * a flag on x.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <unistd.h>
+#include <iobuf/ibuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include "conf_qmail.c"
+
+const char program[] = "pslcomp";
+const int msg_show_pid = 0;
+
+#define PSLMAGIC "mfpsl01"
+
+#define PSL_RULE 1		/* a suffix ends here */
+#define PSL_WILD 2		/* every child is a suffix */
+#define PSL_EXCEPT 4		/* not a suffix, though the parent's * says so */
+
+struct pslhdr {
+  char magic[8];
+  uint32_t nnodes;
+  uint32_t poolsize;
+};
+
+struct pslnode {
+  uint32_t label;		/* offset in pool */
+  uint32_t first;		/* first child */
+  uint16_t nkids;
+  uint8_t len;
+  uint8_t flags;
+};
+
+/* tree as it's built */
+struct tnode {
+  char *label;
+  unsigned len;
+  unsigned flags;
+  unsigned nkids;
+  struct tnode *kids;		/* list until sorted */
+  struct tnode *next;
+  struct tnode **sorted;
+};
+
+static struct tnode root;
+static unsigned long ntnodes = 1;
+static unsigned long poolsize;
+
+static struct tnode* child(struct tnode *n, const char *label, unsigned len)
+{
+  struct tnode *k;
+
+  for(k = n->kids; k; k = k->next)
+    if(k->len == len && !memcmp(k->label, label, len)) return k;
+  if(len > 255) die2(111, "label too long in rule at ", label);
+  if((k = calloc(1, sizeof *k)) == 0 || (k->label = malloc(len)) == 0)
+    die1(111, "out of memory");
+  memcpy(k->label, label, len);
+  k->len = len;
+  k->next = n->kids;
+  n->kids = k;
+  n->nkids++;
+  ntnodes++;
+  poolsize += len;
+  return k;
+}
+
+static void add_rule(str *rule)
+{
+  struct tnode *n = &root;
+  unsigned flag = PSL_RULE;
+  unsigned end, start;
+  unsigned i;
+
+  for(i = 0; i < rule->len; i++) rule->s[i] = tolower((unsigned char)rule->s[i]);
+  if(rule->s[0] == '!') {
+    flag = PSL_EXCEPT;
+    str_lcut(rule, 1);
+  }
+
+  /* walk the labels right to left */
+  for(end = rule->len; end > 0; end = start ? start - 1 : 0) {
+    for(start = end; start > 0 && rule->s[start-1] != '.'; start--)
+      ;
+    if(start == 0 && end == 1 && rule->s[0] == '*') {
+      n->flags |= PSL_WILD;
+      return;
+    }
+    if(end == start) return;	/* empty label, junk */
+    n = child(n, rule->s + start, end - start);
+    if(start == 0) break;
+  }
+  n->flags |= flag;
+}
+
+static int kidcmp(const void *a, const void *b)
+{
+  const struct tnode *x = *(const struct tnode **)a;
+  const struct tnode *y = *(const struct tnode **)b;
+  int c = memcmp(x->label, y->label, x->len < y->len ? x->len : y->len);
+
+  return c ? c : (int)x->len - (int)y->len;
+}
+
+static void sort_kids(struct tnode *n)
+{
+  struct tnode *k;
+  unsigned i = 0;
+
+  if(!n->nkids) return;
+  if(n->nkids > 65535) die1(111, "too many labels under one node");
+  if((n->sorted = malloc(n->nkids * sizeof *n->sorted)) == 0)
+    die1(111, "out of memory");
+  for(k = n->kids; k; k = k->next) n->sorted[i++] = k;
+  qsort(n->sorted, n->nkids, sizeof *n->sorted, kidcmp);
+  for(i = 0; i < n->nkids; i++) sort_kids(n->sorted[i]);
+}
+
+int main(int argc, char **argv)
+{
+  const char *src = "control/effective_tld_names.dat";
+  const char *dst = "control/effective_tld_names.psl";
+  const char *qh;
+  struct pslhdr h;
+  struct pslnode *nodes;
+  struct tnode **queue;
+  char *pool;
+  unsigned long qhead, qtail, poolpos;
+  unsigned i;
+  str line, tmp;
+  ibuf in;
+  FILE *out;
+
+  if(argc > 1) src = argv[1];
+  if(argc > 2) dst = argv[2];
+  if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+  if(chdir(qh) == -1) die2sys(111, "can't chdir to ", qh);
+
+  if(!ibuf_open(&in, src, 0)) die2sys(111, "can't open ", src);
+  str_init(&line);
+  while(ibuf_getstr(&in, &line, '\n')) {
+    str_strip(&line);
+    if(line.len == 0 || str_starts(&line, "//")) continue;
+    for(i = 0; i < line.len; i++)	/* rule ends at white space */
+      if(isspace((unsigned char)line.s[i])) break;
+    str_truncate(&line, i);
+    add_rule(&line);
+  }
+  ibuf_close(&in);
+  sort_kids(&root);
+
+  /* lay it out breadth first, so each node's children are together */
+  nodes = calloc(ntnodes, sizeof *nodes);
+  queue = malloc(ntnodes * sizeof *queue);
+  pool = malloc(poolsize + 1);
+  if(!nodes || !queue || !pool) die1(111, "out of memory");
+  queue[0] = &root;
+  qtail = 1;
+  poolpos = 0;
+  for(qhead = 0; qhead < qtail; qhead++) {
+    struct tnode *n = queue[qhead];
+    struct pslnode *pn = &nodes[qhead];
+
+    pn->label = poolpos;
+    pn->len = n->len;
+    pn->flags = n->flags;
+    memcpy(pool + poolpos, n->label, n->len);
+    poolpos += n->len;
+    pn->first = qtail;
+    pn->nkids = n->nkids;
+    for(i = 0; i < n->nkids; i++) queue[qtail++] = n->sorted[i];
+  }
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, PSLMAGIC, 8);
+  h.nnodes = ntnodes;
+  h.poolsize = poolsize;
+
+  str_init(&tmp);
+  str_copy2s(&tmp, dst, ".tmp");
+  if((out = fopen(tmp.s, "w")) == 0) die2sys(111, "can't create ", tmp.s);
+  if(fwrite(&h, sizeof h, 1, out) != 1
+     || fwrite(nodes, sizeof *nodes, ntnodes, out) != ntnodes
+     || (poolsize && fwrite(pool, poolsize, 1, out) != 1)
+     || fflush(out) != 0
+     || fsync(fileno(out)) != 0
+     || fclose(out) != 0)
+    die2sys(111, "can't write ", tmp.s);
+  if(rename(tmp.s, dst) != 0) die2sys(111, "can't rename to ", dst);
+  return 0;
+}
@@ -0,0 +1,165 @@
+/*
+ * qmail-queue injection helper for backend-qmailsump
+ * Keeps a few small long-lived processes around to start qmail-queue,
+ * so the mailfront process (big, lots of libraries mapped) never has
+ * to fork for each message.
+ *
+ * usage: qqhelper socket [workers]
+ * listens on unix socket, default 4 workers
+ * QMAILHOME and QMAILQUEUE as for backend-qmailsump
+ * qmail-queue runs with qqhelper's environment, not the session's
+ *
+ * protocol, one message per connection:
+ *  client sends one byte with the message fd attached (SCM_RIGHTS)
+ *  qmail-queue is started with the message fd as fd 0 and the
+ *    connection as fd 1, so the client then writes the envelope
+ *    to the connection just as it would to qmail-queue
+ *  when qmail-queue exits, helper replies with two ints,
+ *    exit status (-1 if it crashed) and its pid
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <net/socket.h>
+#include <msg/msg.h>
+#include "conf_qmail.c"
+
+const char program[] = "qqhelper";
+const int msg_show_pid = 1;
+
+extern char **environ;
+
+static const char* qqargs[2] = { 0, 0 };
+
+/* get the message fd the client sent us */
+static int getfd(int conn)
+{
+  struct msghdr mh;
+  struct iovec iov;
+  struct cmsghdr *cmh;
+  char c;
+  union {
+    struct cmsghdr h;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } cm;
+  int fd;
+
+  memset(&mh, 0, sizeof mh);
+  iov.iov_base = &c;
+  iov.iov_len = 1;
+  mh.msg_iov = &iov;
+  mh.msg_iovlen = 1;
+  mh.msg_control = cm.buf;
+  mh.msg_controllen = sizeof cm.buf;
+  if(recvmsg(conn, &mh, 0) != 1) return -1;
+  cmh = CMSG_FIRSTHDR(&mh);
+  if(!cmh || cmh->cmsg_level != SOL_SOCKET || cmh->cmsg_type != SCM_RIGHTS)
+    return -1;
+  memcpy(&fd, CMSG_DATA(cmh), sizeof fd);
+  return fd;
+}
+
+static void handle(int conn)
+{
+  posix_spawn_file_actions_t fa;
+  int reply[2] = { -1, 0 };
+  int msgfd;
+  pid_t pid, w;
+  int status = 0;
+
+  if((msgfd = getfd(conn)) < 0) {
+    warn1("no message fd from client");
+    return;
+  }
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, msgfd, 0);
+  posix_spawn_file_actions_adddup2(&fa, conn, 1);
+  if(posix_spawnp(&pid, qqargs[0], &fa, 0, (char**)qqargs, environ) != 0) {
+    warn2sys("can't start ", qqargs[0]);
+    pid = -1;
+  }
+  posix_spawn_file_actions_destroy(&fa);
+  close(msgfd);
+
+  if(pid > 0) {
+    reply[1] = pid;
+    while((w = waitpid(pid, &status, 0)) == -1 && errno == EINTR)
+      ;
+    if(w == -1) {
+      warn1sys("waitpid failed");
+      reply[0] = 81;
+    }
+    else if(WIFEXITED(status)) reply[0] = WEXITSTATUS(status);
+  } else
+    reply[0] = 81;		/* internal bug, close enough */
+
+  if(write(conn, reply, sizeof reply) != sizeof reply)
+    warn1sys("can't reply to client");
+}
+
+static void worker(int lfd)
+{
+  int conn;
+
+  for(;;) {
+    if((conn = accept(lfd, 0, 0)) < 0) {
+      if(errno != EINTR) warn1sys("accept failed");
+      continue;
+    }
+    handle(conn);
+    close(conn);
+  }
+}
+
+static void start_worker(int lfd)
+{
+  pid_t pid;
+
+  while((pid = fork()) == -1) {
+    warn1sys("can't fork worker");
+    sleep(1);
+  }
+  if(pid == 0) worker(lfd);
+}
+
+int main(int argc, char **argv)
+{
+  const char *qh;
+  int nworkers = 4;
+  int lfd;
+  int i;
+
+  if(argc < 2) die1(111, "usage: qqhelper socket [workers]");
+  if(argc > 2) nworkers = atoi(argv[2]);
+  if(nworkers < 1) nworkers = 1;
+
+  if((qqargs[0] = getenv("QMAILQUEUE")) == 0) qqargs[0] = "bin/qmail-queue";
+  if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+  if(chdir(qh) == -1) die2sys(111, "can't chdir to ", qh);
+  signal(SIGPIPE, SIG_IGN);
+
+  unlink(argv[1]);
+  if((lfd = socket_unixstr()) < 0
+     || !socket_bindu(lfd, argv[1])
+     || !socket_listen(lfd, 64))
+    die2sys(111, "can't listen on ", argv[1]);
+
+  /* keep the pool full */
+  for(i = 0; i < nworkers; i++) start_worker(lfd);
+  for(;;) {
+    if(wait(0) == -1) {
+      if(errno == EINTR) continue;
+      die1sys(111, "wait failed");
+    }
+    warn1("worker died, replacing it");
+    start_worker(lfd);
+  }
+  return 0;
+}
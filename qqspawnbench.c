@@ -0,0 +1,117 @@
+/*
+ * Time starting qmail-queue the way backend-qmailsump used to, with
+ * fork and exec, against posix_spawnp as it does now, from a process
+ * grown to about the size of a busy mailfront
+ *
+ * usage: qqspawnbench program [rounds [megabytes]]
+ * program is run with /dev/null as fd 0 and 1 and waited for; give it
+ * /bin/true to time just the process start, qmail-queue itself would
+ * leave junk in the queue.  rounds defaults to 1000, megabytes of
+ * touched memory to 64.  Prints starts a second, and the median and
+ * 99th percentile time from start to exit.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <msg/msg.h>
+
+const char program[] = "qqspawnbench";
+const int msg_show_pid = 0;
+
+extern char **environ;
+
+static double *lat;
+
+static double usec_since(const struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_usec - start->tv_usec);
+}
+
+/* what backend-qmailsump did before */
+static pid_t by_fork(char *argv[], int nullfd)
+{
+  pid_t pid = fork();
+
+  if(pid == 0) {
+    dup2(nullfd, 0);
+    dup2(nullfd, 1);
+    execvp(argv[0], argv);
+    _exit(127);
+  }
+  return pid;
+}
+
+static pid_t by_spawn(char *argv[], int nullfd)
+{
+  posix_spawn_file_actions_t fa;
+  pid_t pid;
+
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, nullfd, 0);
+  posix_spawn_file_actions_adddup2(&fa, nullfd, 1);
+  if(posix_spawnp(&pid, argv[0], &fa, 0, argv, environ) != 0) pid = -1;
+  posix_spawn_file_actions_destroy(&fa);
+  return pid;
+}
+
+static int by_value(const void *a, const void *b)
+{
+  double x = *(const double *)a, y = *(const double *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+static void run(const char *what, pid_t (*start)(char *[], int),
+		char *argv[], int nullfd, int rounds)
+{
+  struct timeval all, one;
+  double secs;
+  pid_t pid;
+  int i, status;
+
+  gettimeofday(&all, NULL);
+  for(i = 0; i < rounds; i++) {
+    gettimeofday(&one, NULL);
+    if((pid = start(argv, nullfd)) < 0) die2sys(1, "can't start ", argv[0]);
+    while(waitpid(pid, &status, 0) < 0)
+      if(errno != EINTR) die1sys(1, "waitpid failed");
+    lat[i] = usec_since(&one);
+  }
+  secs = usec_since(&all) / 1e6;
+  qsort(lat, rounds, sizeof *lat, by_value);
+  printf("%-12s %8.0f /s  p50 %7.0f us  p99 %7.0f us\n", what,
+	 secs > 0 ? rounds / secs : 0, lat[rounds / 2], lat[rounds * 99 / 100]);
+}
+
+int main(int argc, char *argv[])
+{
+  int rounds = argc > 2 ? atoi(argv[2]) : 1000;
+  unsigned long mb = argc > 3 ? strtoul(argv[3], 0, 10) : 64;
+  char *args[2];
+  char *ballast;
+  int nullfd;
+
+  if(argc < 2) die1(1, "usage: qqspawnbench program [rounds [megabytes]]");
+  if(rounds <= 0) die1(1, "rounds must be positive");
+  if((lat = malloc(rounds * sizeof *lat)) == 0) die1(1, "out of memory");
+  /* touched, so fork has page tables to copy */
+  if(mb && (ballast = malloc(mb << 20)) == 0) die1(1, "out of memory");
+  if(mb) memset(ballast, 1, mb << 20);
+  if((nullfd = open("/dev/null", O_RDWR)) < 0) die1sys(1, "can't open /dev/null");
+
+  args[0] = argv[1];
+  args[1] = 0;
+  run("fork+exec", by_fork, args, nullfd, rounds);
+  run("posix_spawn", by_spawn, args, nullfd, rounds);
+  return 0;
+}
@@ -0,0 +1,463 @@
+/*
+ * rufsend, sends the DMARC failure reports plugin-arlog spools
+ *
+ * usage: rufsend rufspool
+ * run it every so often, from cron or a loop; each run is one window
+ * RUFFROM: envelope sender and From: of the reports, required
+ * RUFLIMIT: most reports to any one address in a day, default 24
+ * QMAILHOME and QMAILQUEUE as for backend-qmailsump
+ *
+ * plugin-arlog appends a line per failing message to "pending",
+ *   time TAB ruf-uris TAB from-domain TAB client-ip TAB mail-from TAB
+ *   authentication-results [TAB header-field]...
+ * This takes the lot, and sends each failure as an AFRF report (RFC
+ * 6591, multipart/report with a message/feedback-report part saying
+ * Feedback-Type: auth-failure, then the header fields arlog kept) to
+ * its ruf addresses, one qmail-queue run per report.  An address in
+ * another domain than the From: domain only gets reports if
+ * <from-domain>._report._dmarc.<its domain> has a DMARC1 TXT record
+ * (RFC 7489 7.1), so nobody can have reports sent to a third party.
+ * The addresses reports went to, and how many today, are in the file
+ * "rate".  Reports to addresses over RUFLIMIT are dropped with a note
+ * in the log, so a phishing wave costs a few reports, not one per
+ * message; a report only counts once qmail-queue has taken it.  If
+ * qmail-queue or DNS fails temporarily the line goes back into
+ * "pending".
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <iobuf/ibuf.h>
+#include <misc/misc.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include "conf_qmail.c"
+
+const char program[] = "rufsend";
+const int msg_show_pid = 0;
+
+extern char **environ;
+
+/* external destinations looked up this run */
+struct extdest {
+  str key;			/* from-domain NUL dest-domain */
+  int ok;
+};
+
+struct rate {
+  str addr;
+  unsigned long day;
+  unsigned count;
+};
+
+static const char* qqargs[2] = { 0, 0 };
+static int spooldir;
+static struct extdest *extdests;
+static unsigned nextdests;
+static struct rate *rates;
+static unsigned nrates;
+static unsigned ratelimit = 24;
+static unsigned long today;
+static const char *ruffrom;
+
+static struct rate* find_rate(const str *addr)
+{
+  unsigned i;
+
+  for(i = 0; i < nrates; i++)
+    if(!str_diff(&rates[i].addr, addr)) return &rates[i];
+  if((rates = realloc(rates, (nrates + 1) * sizeof *rates)) == 0)
+    die1(111, "out of memory");
+  memset(&rates[nrates], 0, sizeof *rates);
+  str_init(&rates[nrates].addr);
+  if(!str_copy(&rates[nrates].addr, addr)) die1(111, "out of memory");
+  rates[nrates].day = today;
+  return &rates[nrates++];
+}
+
+/* "addr day count" lines, old days are forgotten */
+static void load_rates(void)
+{
+  ibuf in;
+  str line, addr;
+  int fd;
+
+  if((fd = openat(spooldir, "rate", O_RDONLY)) < 0) {
+    if(errno != ENOENT) die1sys(111, "can't open rate");
+    return;
+  }
+  ibuf_init(&in, fd, 0, IOBUF_NEEDSCLOSE, 0);
+  str_init(&line);
+  str_init(&addr);
+  while(ibuf_getstr(&in, &line, '\n')) {
+    char *sp, *end;
+    unsigned long day;
+    unsigned count;
+
+    str_strip(&line);
+    if((sp = strchr(line.s, ' ')) == 0) continue;
+    day = strtoul(sp+1, &end, 10);
+    count = strtoul(end, 0, 10);
+    if(day != today) continue;
+    str_copyb(&addr, line.s, sp - line.s);
+    find_rate(&addr)->count = count;
+  }
+  ibuf_close(&in);
+  str_free(&line);
+  str_free(&addr);
+}
+
+static void save_rates(void)
+{
+  str out;
+  unsigned i;
+  int fd;
+
+  str_init(&out);
+  for(i = 0; i < nrates; i++) {
+    if(rates[i].day != today) continue;
+    if(!str_cat(&out, &rates[i].addr) || !str_catc(&out, ' ')
+       || !str_catu(&out, rates[i].day) || !str_catc(&out, ' ')
+       || !str_catu(&out, rates[i].count) || !str_catc(&out, '\n'))
+      die1(111, "out of memory");
+  }
+  if((fd = openat(spooldir, "rate.tmp", O_WRONLY|O_CREAT|O_TRUNC, 0600)) < 0
+     || write(fd, out.s, out.len) != (ssize_t)out.len
+     || close(fd) != 0
+     || renameat(spooldir, "rate.tmp", spooldir, "rate") != 0)
+    warn1sys("can't save rate");
+  str_free(&out);
+}
+
+/* does dest take fromdom's reports, 1 yes, 0 no, -1 try later */
+static int ext_check(const char *fromdom, const char *dest)
+{
+  unsigned char ans[4096];
+  static str name, txt;
+  const unsigned char *p, *e;
+  unsigned long flen = strlen(fromdom), dlen = strlen(dest);
+  ns_msg msg;
+  ns_rr rr;
+  unsigned i;
+  int len, ok = 0;
+
+  /* its own domain, or under it, is fine */
+  if(dlen >= flen && !strcasecmp(dest + dlen - flen, fromdom)
+     && (dlen == flen || dest[dlen - flen - 1] == '.'))
+    return 1;
+
+  str_copyb(&name, fromdom, flen + 1);
+  str_cats(&name, dest);
+  for(i = 0; i < nextdests; i++)
+    if(!str_diff(&extdests[i].key, &name)) return extdests[i].ok;
+
+  if(!str_copy3s(&name, fromdom, "._report._dmarc.", dest))
+    die1(111, "out of memory");
+  if((len = res_query(name.s, C_IN, T_TXT, ans, sizeof ans)) < 0) {
+    if(h_errno != HOST_NOT_FOUND && h_errno != NO_DATA) return -1;
+  }
+  else if(ns_initparse(ans, len, &msg) < 0) return -1;
+  else
+    for(i = 0; !ok && i < ns_msg_count(msg, ns_s_an); i++) {
+      if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) return -1;
+      if(ns_rr_type(rr) != T_TXT) continue;
+      str_truncate(&txt, 0);
+      for(p = ns_rr_rdata(rr), e = p + ns_rr_rdlen(rr); p < e; p += 1 + *p) {
+	if(p + 1 + *p > e) break;
+	if(!str_catb(&txt, (const char *)p+1, *p)) die1(111, "out of memory");
+      }
+      ok = str_case_starts(&txt, "v=DMARC1")
+	&& (txt.len == 8 || txt.s[8] == ';' || txt.s[8] == ' ');
+    }
+
+  if((extdests = realloc(extdests, (nextdests + 1) * sizeof *extdests)) == 0)
+    die1(111, "out of memory");
+  str_init(&extdests[nextdests].key);
+  str_copyb(&extdests[nextdests].key, fromdom, flen + 1);
+  str_cats(&extdests[nextdests].key, dest);
+  extdests[nextdests++].ok = ok;
+  if(!ok) warn3("no DMARC1 record at ", name.s, ", not reporting there");
+  return ok;
+}
+
+/* run qmail-queue on a message and envelope, returns its exit status or -1 */
+static int inject(const str *msg, const str *env)
+{
+  posix_spawn_file_actions_t fa;
+  int mpipe[2], epipe[2];
+  pid_t pid;
+  int status;
+  int ok;
+
+  if(pipe(mpipe) != 0) return -1;
+  if(pipe(epipe) != 0) {
+    close(mpipe[0]);
+    close(mpipe[1]);
+    return -1;
+  }
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, mpipe[0], 0);
+  posix_spawn_file_actions_adddup2(&fa, epipe[0], 1);
+  posix_spawn_file_actions_addclose(&fa, mpipe[1]);
+  posix_spawn_file_actions_addclose(&fa, epipe[1]);
+  ok = posix_spawnp(&pid, qqargs[0], &fa, 0, (char**)qqargs, environ) == 0;
+  posix_spawn_file_actions_destroy(&fa);
+  close(mpipe[0]);
+  close(epipe[0]);
+  if(!ok) {
+    close(mpipe[1]);
+    close(epipe[1]);
+    warn2sys("can't start ", qqargs[0]);
+    return -1;
+  }
+
+  /* qmail-queue reads all the message before the envelope */
+  ok = write(mpipe[1], msg->s, msg->len) == (ssize_t)msg->len;
+  close(mpipe[1]);
+  ok = ok && write(epipe[1], env->s, env->len) == (ssize_t)env->len;
+  close(epipe[1]);
+
+  while(waitpid(pid, &status, 0) == -1)
+    if(errno != EINTR) return -1;
+  if(!WIFEXITED(status)) return -1;
+  return ok ? WEXITSTATUS(status) : -1;
+}
+
+/* put a line back for the next run */
+static void requeue(const str *line)
+{
+  struct stat fst, pst;
+  int fd, i;
+
+  /* same dance as plugin-arlog, in case another run renames it */
+  for(i = 0; i < 5; i++) {
+    if((fd = openat(spooldir, "pending", O_WRONLY|O_APPEND|O_CREAT, 0600)) < 0)
+      break;
+    if(flock(fd, LOCK_SH) != 0 || fstat(fd, &fst) != 0) {
+      close(fd);
+      break;
+    }
+    if(fstatat(spooldir, "pending", &pst, 0) == 0 && pst.st_ino == fst.st_ino
+       && pst.st_dev == fst.st_dev) {
+      if(write(fd, line->s, line->len) == (ssize_t)line->len) {
+	close(fd);
+	return;
+      }
+      close(fd);
+      break;
+    }
+    close(fd);
+  }
+  warn1sys("can't requeue failure line, lost");
+}
+
+#define RUFFIELDS 6		/* before the header fields */
+
+/* send one pending line as an AFRF report */
+static void send_report(str *line, unsigned n)
+{
+  static str orig, addr, to, env, msg, boundary;
+  static unsigned *sendto;	/* indexes in rates, which may move */
+  static unsigned sendsize;
+  char *f[RUFFIELDS];
+  char date[64], arrival[64];
+  const char *s, *e, *host, *ruf, *fromdom, *hdrs;
+  unsigned long rufend;
+  unsigned naddrs = 0, i;
+  time_t now = time(0), t;
+  int status;
+
+  if(!str_catc(line, '\n') || !str_copy(&orig, line)) die1(111, "out of memory");
+  for(s = line->s, i = 0; i < RUFFIELDS; i++) {
+    f[i] = (char *)s;
+    if((s = strpbrk(s, "\t\n")) == 0 || (*s == '\n' && i < RUFFIELDS - 1)) {
+      warn1("bad line in pending, skipping");
+      return;
+    }
+    s++;
+  }
+  hdrs = s;			/* header fields, TAB separated */
+  ruf = f[1];
+  rufend = f[2] - 1 - f[1];
+  for(i = 1; i < RUFFIELDS; i++) f[i][-1] = 0;
+  line->s[line->len-1] = 0;
+  if(hdrs[-1] == '\t') ((char *)hdrs)[-1] = 0;
+  else hdrs = "";
+  fromdom = f[2];
+
+  /* mailto:addr[!size], comma separated, as arlog spools them; a bare
+     addr is taken too, other schemes are ignored */
+  str_truncate(&to, 0);
+  str_copys(&env, "F");
+  str_cats(&env, ruffrom);
+  str_catc(&env, 0);
+  for(s = ruf; s < ruf + rufend; s = e + 1) {
+    struct rate *r;
+
+    if((e = memchr(s, ',', ruf + rufend - s)) == 0) e = ruf + rufend;
+    while(s < e && *s == ' ') s++;
+    if(e - s >= 7 && !strncasecmp(s, "mailto:", 7)) s += 7;
+    else if((host = memchr(s, ':', e - s)) != 0
+	    && memchr(s, '@', host - s) == 0) continue;
+    str_copyb(&addr, s, e - s);
+    if((host = memchr(addr.s, '!', addr.len)) != 0) str_truncate(&addr, host - addr.s);
+    str_strip(&addr);
+    if(!addr.len || (host = strchr(addr.s, '@')) == 0) continue;
+
+    switch(ext_check(fromdom, host + 1)) {
+    case 0: continue;
+    case -1:
+      warn2("DNS trouble checking ", addr.s);
+      requeue(&orig);
+      return;
+    }
+    r = find_rate(&addr);
+    if(r->count >= ratelimit) {
+      warn3("over RUFLIMIT for ", addr.s, ", dropped a report");
+      continue;
+    }
+    if(naddrs >= sendsize) {
+      sendsize = naddrs + 8;
+      if((sendto = realloc(sendto, sendsize * sizeof *sendto)) == 0)
+	die1(111, "out of memory");
+    }
+    sendto[naddrs] = r - rates;
+    if(naddrs++) str_cats(&to, ", ");
+    str_cat(&to, &addr);
+    str_catc(&env, 'T');
+    str_cat(&env, &addr);
+    str_catc(&env, 0);
+  }
+  if(!naddrs) return;
+  if(!str_catc(&env, 0)) die1(111, "out of memory");
+
+  host = strrchr(ruffrom, '@');
+  host = host ? host + 1 : "localhost";
+  strftime(date, sizeof date, "%a, %d %b %Y %H:%M:%S +0000", gmtime(&now));
+  t = strtoul(f[0], 0, 10);
+  strftime(arrival, sizeof arrival, "%a, %d %b %Y %H:%M:%S +0000", gmtime(&t));
+  str_copys(&boundary, "ruf.");
+  str_catu(&boundary, now);
+  str_catc(&boundary, '.');
+  str_catu(&boundary, getpid());
+  str_catc(&boundary, '.');
+  str_catu(&boundary, n);
+
+  str_copy2s(&msg, "From: ", ruffrom);
+  str_cat3s(&msg, "\nTo: ", to.s, "\n");
+  str_cat3s(&msg, "Subject: DMARC failure report for ", fromdom, "\nDate: ");
+  str_cats(&msg, date);
+  str_cat4s(&msg, "\nMessage-ID: <", boundary.s, "@", host);
+  str_cats(&msg, ">\nAuto-Submitted: auto-generated\n"
+	   "MIME-Version: 1.0\n"
+	   "Content-Type: multipart/report; report-type=feedback-report;\n");
+  str_cat3s(&msg, "\tboundary=\"", boundary.s, "\"\n\n");
+
+  str_cat3s(&msg, "--", boundary.s, "\n"
+	    "Content-Type: text/plain; charset=us-ascii\n\n");
+  str_cat3s(&msg, "A message claiming to be from ", fromdom,
+	    " failed DMARC checks here.\n");
+  str_cat4s(&msg, "It came from ", f[3], " on ", arrival);
+  str_cat3s(&msg, ", mail from <", f[4], ">.\n\n");
+
+  str_cat3s(&msg, "--", boundary.s, "\n"
+	    "Content-Type: message/feedback-report\n\n"
+	    "Feedback-Type: auth-failure\n"
+	    "User-Agent: rufsend\n"
+	    "Version: 1\n"
+	    "Auth-Failure: dmarc\n");
+  str_cat3s(&msg, "Authentication-Results: ", f[5], "\n");
+  str_cat3s(&msg, "Original-Mail-From: <", f[4], ">\n");
+  str_cat3s(&msg, "Arrival-Date: ", arrival, "\n");
+  str_cat3s(&msg, "Source-IP: ", f[3], "\n");
+  str_cat3s(&msg, "Reported-Domain: ", fromdom, "\n\n");
+
+  if(*hdrs) {
+    str_cat3s(&msg, "--", boundary.s, "\n"
+	      "Content-Type: text/rfc822-headers\n\n");
+    for(s = hdrs; *s; s = *e ? e + 1 : e) {
+      if((e = strchr(s, '\t')) == 0) e = s + strlen(s);
+      str_catb(&msg, s, e - s);
+      str_catc(&msg, '\n');
+    }
+    str_catc(&msg, '\n');
+  }
+  if(!str_cat3s(&msg, "--", boundary.s, "--\n")) die1(111, "out of memory");
+
+  status = inject(&msg, &env);
+  if(status == 0)
+    for(i = 0; i < naddrs; i++) rates[sendto[i]].count++;
+  else if(status == -1 || status < 11 || status > 40) {
+    warn2("qmail-queue failed temporarily, exit ", utoa(status));
+    requeue(&orig);
+  }
+  else
+    warn3("qmail-queue rejected report for ", fromdom, ", dropped");
+}
+
+int main(int argc, char **argv)
+{
+  const char *qh;
+  const char *s;
+  struct stat st;
+  ibuf in;
+  str line;
+  unsigned i;
+  int fd;
+
+  if(argc != 2) die1(111, "usage: rufsend rufspool");
+  if((ruffrom = getenv("RUFFROM")) == 0) die1(111, "RUFFROM isn't set");
+  if((s = getenv("RUFLIMIT")) != 0) ratelimit = strtoul(s, 0, 10);
+  if((qqargs[0] = getenv("QMAILQUEUE")) == 0) qqargs[0] = "bin/qmail-queue";
+  today = time(0) / 86400;
+
+  if((spooldir = open(argv[1], O_RDONLY|O_DIRECTORY)) < 0)
+    die2sys(111, "can't open ", argv[1]);
+
+  /* a batch left from a run that died goes first, else take pending */
+  if(fstatat(spooldir, "batch", &st, 0) != 0) {
+    if(errno != ENOENT) die1sys(111, "can't stat batch");
+    if(renameat(spooldir, "pending", spooldir, "batch") != 0) {
+      if(errno == ENOENT) return 0;	/* nothing failed */
+      die1sys(111, "can't rename pending");
+    }
+  }
+  if((fd = openat(spooldir, "batch", O_RDONLY)) < 0)
+    die1sys(111, "can't open batch");
+  /* wait out anyone still writing to it; later writers find it isn't
+     pending any more and open the new one, so don't hold the lock */
+  if(flock(fd, LOCK_EX) != 0) die1sys(111, "can't lock batch");
+  flock(fd, LOCK_UN);
+
+  load_rates();
+  if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+  if(chdir(qh) == -1) die2sys(111, "can't chdir to ", qh);
+  signal(SIGPIPE, SIG_IGN);
+
+  ibuf_init(&in, fd, 0, IOBUF_NEEDSCLOSE, 0);
+  str_init(&line);
+  for(i = 0; ibuf_getstr(&in, &line, '\n'); i++) {
+    if(line.len && line.s[line.len-1] == '\n') str_truncate(&line, line.len-1);
+    if(line.len) send_report(&line, i);
+  }
+  ibuf_close(&in);
+  save_rates();
+
+  if(unlinkat(spooldir, "batch", 0) != 0) die1sys(111, "can't remove batch");
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*
+ * Find line ends in message text, a block at a time
+ * Separate module so every plugin shares one copy per process
+ *
+ * unsigned lf_scan(const char *s, unsigned long len, unsigned long *offs,
+ *   unsigned max)
+ *  -> number of LFs found in s, up to max, their offsets in offs
+ * int lf_crlf(const char *s, unsigned long len, struct iovec *iov,
+ *   int maxiov, unsigned long *done)
+ *  -> number of iovecs, up to maxiov, that make s with each LF turned
+ *  into CRLF, pointing into s rather than copying it; *done is how much
+ *  of s they cover, so call again from there until it's all done
+ * const char* lf_kernel() -> which scanner is in use
+ *
+ * The scanner compares 32 bytes at a time with AVX2 or 16 with SSE2,
+ * picked at the first call by what the CPU has, and falls back to
+ * memchr elsewhere.  SCANLF=avx2, sse2 or scalar in the environment
+ * forces one, to compare them.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define LF_X86 1
+#endif
+
+typedef unsigned (*lf_scanner)(const char *, unsigned long, unsigned long *, unsigned);
+
+static unsigned lf_scan_scalar(const char *s, unsigned long len,
+			       unsigned long *offs, unsigned max)
+{
+  const char *p = s;
+  const char *end = s + len;
+  unsigned n = 0;
+
+  while(n < max && p < end && (p = memchr(p, '\n', end - p)) != 0) {
+    offs[n++] = p - s;
+    p++;
+  }
+  return n;
+}
+
+#ifdef LF_X86
+/* LFs in the bytes of mask, at base */
+#define LF_BITS(mask, base) \
+  while(mask) { \
+    if(n == max) return n; \
+    offs[n++] = (base) + __builtin_ctz(mask); \
+    mask &= mask - 1; \
+  }
+
+__attribute__((target("sse2")))
+static unsigned lf_scan_sse2(const char *s, unsigned long len,
+			     unsigned long *offs, unsigned max)
+{
+  const __m128i lf = _mm_set1_epi8('\n');
+  unsigned long i = 0;
+  unsigned n = 0;
+  unsigned mask;
+
+  for(; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+
+    mask = _mm_movemask_epi8(_mm_cmpeq_epi8(v, lf));
+    LF_BITS(mask, i);
+  }
+  for(; i < len && n < max; i++)
+    if(s[i] == '\n') offs[n++] = i;
+  return n;
+}
+
+__attribute__((target("avx2")))
+static unsigned lf_scan_avx2(const char *s, unsigned long len,
+			     unsigned long *offs, unsigned max)
+{
+  const __m256i lf = _mm256_set1_epi8('\n');
+  unsigned long i = 0;
+  unsigned n = 0;
+  unsigned mask;
+
+  for(; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+
+    mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, lf));
+    LF_BITS(mask, i);
+  }
+  for(; i < len && n < max; i++)
+    if(s[i] == '\n') offs[n++] = i;
+  return n;
+}
+#endif
+
+static lf_scanner scanner;
+static const char *kernel;
+
+static void lf_pick(void)
+{
+  const char *want = getenv("SCANLF");
+
+  scanner = lf_scan_scalar;
+  kernel = "scalar";
+  if(want && !strcmp(want, "scalar")) return;
+#ifdef LF_X86
+  __builtin_cpu_init();
+  if((!want || !strcmp(want, "avx2")) && __builtin_cpu_supports("avx2")) {
+    scanner = lf_scan_avx2;
+    kernel = "avx2";
+  }
+  else if(__builtin_cpu_supports("sse2")) {
+    scanner = lf_scan_sse2;
+    kernel = "sse2";
+  }
+#endif
+}
+
+unsigned lf_scan(const char *s, unsigned long len, unsigned long *offs, unsigned max)
+{
+  if(!scanner) lf_pick();
+  return scanner(s, len, offs, max);
+}
+
+const char* lf_kernel(void)
+{
+  if(!scanner) lf_pick();
+  return kernel;
+}
+
+#define LFBATCH 256
+
+int lf_crlf(const char *s, unsigned long len, struct iovec *iov, int maxiov,
+	    unsigned long *done)
+{
+  static char crlf[2] = { '\r', '\n' };
+  unsigned long offs[LFBATCH];
+  unsigned long start = 0;
+  unsigned i, nlf;
+  int n = 0;
+
+  while(n + 2 <= maxiov && start < len) {
+    unsigned want = (maxiov - n) / 2;
+    unsigned long base = start;
+
+    if(want > LFBATCH) want = LFBATCH;
+    nlf = lf_scan(s + base, len - base, offs, want);
+    for(i = 0; i < nlf; i++) {
+      unsigned long lf = base + offs[i];
+
+      if(lf > start) {
+	iov[n].iov_base = (char *)s + start;
+	iov[n++].iov_len = lf - start;
+      }
+      iov[n].iov_base = crlf;
+      iov[n++].iov_len = 2;
+      start = lf + 1;
+    }
+    if(nlf < want) {		/* no more LFs, the rest as is */
+      if(start < len) {
+	iov[n].iov_base = (char *)s + start;
+	iov[n++].iov_len = len - start;
+	start = len;
+      }
+      break;
+    }
+  }
+  *done = start;
+  return n;
+}
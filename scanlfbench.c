@@ -0,0 +1,96 @@
+/*
+ * Time the LF -> CRLF pass plugin-sauser makes over a message,
+ * the old way a line at a time through ibuf/obuf against scanlf's
+ * iovecs, both written to /dev/null
+ *
+ * usage: scanlfbench file [rounds]
+ * rounds defaults to 100; SCANLF picks the scanner as in scanlf.c,
+ * run it once with each to compare them
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <iobuf/ibuf.h>
+#include <iobuf/obuf.h>
+#include <msg/msg.h>
+#include <str/str.h>
+#include "scanlf.c"
+
+const char program[] = "scanlfbench";
+const int msg_show_pid = 0;
+
+#define BENCHIOV 256
+
+static double secs_since(const struct timeval *start)
+{
+  struct timeval now;
+
+  gettimeofday(&now, NULL);
+  return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+/* what plugin-sauser did before */
+static void by_line(int fd, int out)
+{
+  static str line;
+  ibuf in;
+  obuf ob;
+
+  lseek(fd, 0, SEEK_SET);
+  ibuf_init(&in, fd, 0, 0, 0);
+  obuf_init(&ob, out, 0, 0, 0);
+  while(ibuf_getstr(&in, &line, '\n')) {
+    obuf_write(&ob, line.s, line.len-1);
+    obuf_write(&ob, "\r\n", 2);
+  }
+  obuf_flush(&ob);
+}
+
+static void by_iov(const char *map, unsigned long size, int out)
+{
+  struct iovec iov[BENCHIOV];
+  unsigned long pos, done;
+  int n;
+
+  for(pos = 0; pos < size; pos += done) {
+    n = lf_crlf(map + pos, size - pos, iov, BENCHIOV, &done);
+    if(writev(out, iov, n) < 0) die1sys(1, "writev failed");
+  }
+}
+
+static void report(const char *what, unsigned long bytes, double secs)
+{
+  printf("%-12s %8.3f s %8.3f GB/s\n", what, secs, secs > 0 ? bytes / secs / 1e9 : 0);
+}
+
+int main(int argc, char *argv[])
+{
+  struct timeval start;
+  struct stat st;
+  char *map;
+  int fd, out, i;
+  int rounds = argc > 2 ? atoi(argv[2]) : 100;
+
+  if(argc < 2) die1(1, "usage: scanlfbench file [rounds]");
+  if((fd = open(argv[1], O_RDONLY)) < 0 || fstat(fd, &st) != 0)
+    die2sys(1, "can't open ", argv[1]);
+  if(!st.st_size) die2(1, "empty file ", argv[1]);
+  if((out = open("/dev/null", O_WRONLY)) < 0) die1sys(1, "can't open /dev/null");
+  map = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if(map == MAP_FAILED) die2sys(1, "can't map ", argv[1]);
+
+  gettimeofday(&start, NULL);
+  for(i = 0; i < rounds; i++) by_line(fd, out);
+  report("ibuf_getstr", (unsigned long)st.st_size * rounds, secs_since(&start));
+
+  gettimeofday(&start, NULL);
+  for(i = 0; i < rounds; i++) by_iov(map, st.st_size, out);
+  report(lf_kernel(), (unsigned long)st.st_size * rounds, secs_since(&start));
+  return 0;
+}
@@ -0,0 +1,270 @@
+/*
+ * Small hash tables in shared memory, for state that has to be
+ * seen by every mailfront process, not just one session
+ * Separate module so every plugin shares one copy per process
+ *
+ * Each table is a file in the state directory mapped MAP_SHARED.
+ * Entries are keyed by a 64 bit hash of the key and expire after a
+ * TTL given when they're created.  When the probe window is full the
+ * entry closest to expiring is evicted, so tables never fill up.
+ *
+ * shm_open_table(const char *name, unsigned nslots, unsigned vsize)
+ *  -> table handle >= 0, -1 for error
+ *
+ * call these with the table locked:
+ * shm_find(int t, const char *key, unsigned klen, int create, unsigned ttl)
+ *  -> pointer to vsize bytes of value, zeroed if just created,
+ *     0 if not there and create is 0
+ * shm_expire(int t, void *val, unsigned ttl) reset the TTL of an entry
+ * shm_remove(int t, void *val)
+ *
+ * these lock and unlock for you:
+ * shm_fetch(int t, const char *key, unsigned klen, void *val)
+ *  -> 1 if found and copied to val, 0 if not
+ * shm_store(int t, const char *key, unsigned klen, const void *val, unsigned ttl)
+ *  -> 1 for OK, 0 for fail
+ *
+ * shm_lock(int t), shm_unlock(int t) -> 1 for OK, 0 for fail
+ * locks are flock() so a process that dies can't leave one behind
+ *
+ * shm_statedir() -> the state directory, 0 if it isn't safe to use
+ * It's MFSTATE, or /tmp/mailfront.<uid> made mode 700 if that isn't
+ * set.  Everything kept there steers what mail gets through, so the
+ * directory has to belong to us or root and not be writable by anyone
+ * else, and files in it are opened O_NOFOLLOW and must belong to us.
+ * ctlcache.so and spfcomp.so keep their files there too.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <msg/msg.h>
+#include <str/str.h>
+
+#define SHMMAGIC "mfshm01"
+#define SHMMAX 16		/* tables per process */
+#define SHMPROBE 8		/* slots to look at per key */
+
+struct shmhdr {
+  char magic[8];
+  uint32_t nslots;
+  uint32_t vsize;
+};
+
+struct shmslot {
+  uint64_t hash;		/* 0 if empty */
+  int64_t expires;
+  /* value follows */
+};
+
+struct shmtable {
+  int fd;
+  char *map;
+  size_t maplen;
+  unsigned nslots;
+  unsigned vsize;
+  unsigned ssize;		/* slot size, value rounded up */
+};
+
+static struct shmtable shmtables[SHMMAX];
+static int nshmtables;
+
+static uint64_t shm_hash(const char *s, unsigned len)
+{
+  uint64_t h = 14695981039346656037ULL;
+
+  while(len--) {
+    h ^= (unsigned char)*s++;
+    h *= 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+static struct shmslot* shm_slot(struct shmtable *st, unsigned i)
+{
+  return (struct shmslot *)(st->map + sizeof(struct shmhdr) + (size_t)i*st->ssize);
+}
+
+const char* shm_statedir(void)
+{
+  static str dir;
+  static int checked;
+  const char *env = getenv("MFSTATE");
+  struct stat st;
+  int mine;
+
+  if(checked) return dir.len ? dir.s : 0;
+  checked = 1;
+  if(env) {
+    if(!str_copys(&dir, env)) return 0;
+    mine = stat(dir.s, &st) == 0;
+  }
+  else {
+    /* private to us, not something another user could have made first */
+    if(!str_copys(&dir, "/tmp/mailfront.") || !str_catu(&dir, geteuid())) return 0;
+    if(mkdir(dir.s, 0700) != 0 && errno != EEXIST) {
+      msg2("can't make state directory ", dir.s);
+      str_truncate(&dir, 0);
+      return 0;
+    }
+    mine = lstat(dir.s, &st) == 0 && (st.st_mode & 077) == 0;
+  }
+  if(!mine || !S_ISDIR(st.st_mode)
+     || (st.st_uid != geteuid() && st.st_uid != 0)
+     || (st.st_mode & 022)) {
+    msg2("unsafe state directory ", dir.s);
+    str_truncate(&dir, 0);
+    return 0;
+  }
+  return dir.s;
+}
+
+/* a file in the state directory is ours and nobody else can change it */
+int shm_safefile(int fd)
+{
+  struct stat st;
+
+  return fstat(fd, &st) == 0 && S_ISREG(st.st_mode)
+    && st.st_uid == geteuid() && (st.st_mode & 022) == 0;
+}
+
+int shm_lock(int t)
+{
+  return flock(shmtables[t].fd, LOCK_EX) == 0;
+}
+
+int shm_unlock(int t)
+{
+  return flock(shmtables[t].fd, LOCK_UN) == 0;
+}
+
+int shm_open_table(const char *name, unsigned nslots, unsigned vsize)
+{
+  struct shmtable *st;
+  struct shmhdr *h;
+  struct stat sb;
+  const char *dir;
+  str path;
+  int t;
+
+  if(nshmtables >= SHMMAX) return -1;
+  st = &shmtables[nshmtables];
+  st->nslots = nslots;
+  st->vsize = vsize;
+  st->ssize = (sizeof(struct shmslot) + vsize + 7) & ~7U;
+  st->maplen = sizeof *h + (size_t)nslots*st->ssize;
+
+  if((dir = shm_statedir()) == 0) return -1;
+  if(!str_init(&path) || !str_copy3s(&path, dir, "/shm.", name)) return -1;
+  st->fd = open(path.s, O_RDWR|O_CREAT|O_NOFOLLOW, 0600);
+  if(st->fd < 0) {
+    msg2("can't open shared table ", path.s);
+    str_free(&path);
+    return -1;
+  }
+  if(!shm_safefile(st->fd)) {
+    msg2("unsafe shared table ", path.s);
+    str_free(&path);
+    close(st->fd);
+    return -1;
+  }
+  str_free(&path);
+
+  t = nshmtables;
+  if(!shm_lock(t)) goto fail;
+  if(fstat(st->fd, &sb) != 0) goto unlock;
+  if((size_t)sb.st_size != st->maplen) {
+    /* new, or sized differently, start over */
+    if(ftruncate(st->fd, 0) != 0 || ftruncate(st->fd, st->maplen) != 0)
+      goto unlock;
+  }
+  st->map = mmap(0, st->maplen, PROT_READ|PROT_WRITE, MAP_SHARED, st->fd, 0);
+  if(st->map == MAP_FAILED) goto unlock;
+  h = (struct shmhdr *)st->map;
+  if(memcmp(h->magic, SHMMAGIC, 8) || h->nslots != nslots || h->vsize != vsize) {
+    memset(st->map, 0, st->maplen);
+    memcpy(h->magic, SHMMAGIC, 8);
+    h->nslots = nslots;
+    h->vsize = vsize;
+  }
+  shm_unlock(t);
+  nshmtables++;
+  return t;
+
+ unlock:
+  shm_unlock(t);
+ fail:
+  close(st->fd);
+  return -1;
+}
+
+void* shm_find(int t, const char *key, unsigned klen, int create, unsigned ttl)
+{
+  struct shmtable *st = &shmtables[t];
+  struct shmslot *sl, *victim = 0;
+  uint64_t hash = shm_hash(key, klen);
+  time_t now = time(0);
+  unsigned i, j;
+
+  for(i = 0, j = hash % st->nslots; i < SHMPROBE; i++, j = (j+1) % st->nslots) {
+    sl = shm_slot(st, j);
+    if(sl->hash == hash && sl->expires > now) return sl+1;
+    /* empty and expired slots have the lowest expiry of all */
+    if(!victim || (victim->expires > now && sl->expires < victim->expires))
+      victim = sl;
+  }
+  if(!create) return 0;
+
+  victim->hash = hash;
+  victim->expires = now + ttl;
+  memset(victim+1, 0, st->vsize);
+  return victim+1;
+}
+
+void shm_expire(int t, void *val, unsigned ttl)
+{
+  struct shmslot *sl = (struct shmslot *)val - 1;
+
+  sl->expires = time(0) + ttl;
+  (void)t;
+}
+
+void shm_remove(int t, void *val)
+{
+  struct shmslot *sl = (struct shmslot *)val - 1;
+
+  sl->hash = 0;
+  sl->expires = 0;
+  (void)t;
+}
+
+int shm_fetch(int t, const char *key, unsigned klen, void *val)
+{
+  void *v;
+
+  if(t < 0 || !shm_lock(t)) return 0;
+  if((v = shm_find(t, key, klen, 0, 0)) != 0)
+    memcpy(val, v, shmtables[t].vsize);
+  shm_unlock(t);
+  return v != 0;
+}
+
+int shm_store(int t, const char *key, unsigned klen, const void *val, unsigned ttl)
+{
+  void *v;
+
+  if(t < 0 || !shm_lock(t)) return 0;
+  if((v = shm_find(t, key, klen, 1, ttl)) != 0) {
+    memcpy(v, val, shmtables[t].vsize);
+    shm_expire(t, v, ttl);
+  }
+  shm_unlock(t);
+  return v != 0;
+}
@@ -0,0 +1,482 @@
+/*
+ * Compiled SPF policies: a sender domain's SPF record flattened into
+ * a binary trie of address prefixes, so checking a client IP is one
+ * walk down the trie rather than a trip through libspf2
+ * Separate module so every plugin shares one copy per process
+ *
+ * Each compiled domain is a file spf.<domain> in the state directory
+ * (see shm_statedir in shmtab.c), mapped read-only by whoever looks it
+ * up, and ignored unless it's ours.  It's written to a temp file named
+ * for the process and renamed into place, so sessions compiling the
+ * same domain at once can't mix their tries.  It expires when the
+ * shortest DNS TTL seen while compiling runs out, capped at env
+ * SPFCOMPTTL (default 3600) seconds, and is then recompiled by the
+ * next compile call.  Records with macros, exists:, ptr, or anything
+ * else that depends on more than the client IP can't be compiled; a
+ * marker file says so, so they aren't retried until it expires.
+ *
+ * spfc_lookup(const char *domain, const char *ip, int *qual)
+ *  -> 1 with the SPF qualifier + - ~ ? in qual, 0 if the domain can't
+ *     be compiled, -1 if there's no current compiled trie
+ * spfc_compile(const char *domain)
+ *  -> 1 compiled, 0 can't be compiled, -1 for trouble
+ *
+ * Mechanisms keep their order: every trie node on the way to the IP
+ * that carries a prefix has the position of its mechanism, and the
+ * earliest one wins, as SPF's first match does.  An include is
+ * flattened into the includer's sequence; only its + terms can match,
+ * so anything else in it makes the domain uncompilable.
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <arpa/nameser.h>
+#include <resolv.h>
+#include <netdb.h>
+#include <msg/msg.h>
+#include <str/str.h>
+
+extern const char* shm_statedir(void);
+extern int shm_safefile(int fd);
+
+#define SPFCMAGIC "mfspf01"
+
+#define SPFC_NOCOMP 1		/* marker, domain can't be compiled */
+
+#define MAXLOOKUPS 10		/* RFC 7208 4.6.4 */
+#define MAXDEPTH 10
+
+struct spfchdr {
+  char magic[8];
+  uint32_t expires;
+  uint32_t nnodes;
+  uint8_t dflt;			/* qualifier when nothing matches */
+  uint8_t flags;
+  uint8_t pad[2];
+};
+
+/* node 0 is the IPv4 root, node 1 the IPv6 root */
+struct spfcnode {
+  uint32_t kid[2];
+  uint32_t order;		/* 0 if no prefix ends here */
+  uint8_t qual;
+  uint8_t pad[3];
+};
+
+static int mkpath(str *path, const char *domain)
+{
+  const char *dir;
+  unsigned i;
+
+  if(!*domain || strchr(domain, '/') || domain[0] == '.') return 0;
+  if((dir = shm_statedir()) == 0) return 0;
+  if(!str_copy3s(path, dir, "/spf.", domain)) return 0;
+  for(i = path->len - strlen(domain); i < path->len; i++)
+    path->s[i] = tolower((unsigned char)path->s[i]);
+  return 1;
+}
+
+int spfc_lookup(const char *domain, const char *ip, int *qual)
+{
+  static str path;
+  const struct spfchdr *h;
+  const struct spfcnode *nodes;
+  unsigned char addr[16];
+  unsigned bits, i, n;
+  uint32_t best = 0;
+  struct stat st;
+  void *m;
+  int fd, r;
+
+  if(strchr(ip, ':')) {
+    if(inet_pton(AF_INET6, ip, addr) != 1) return -1;
+    bits = 128;
+    n = 1;
+  }
+  else {
+    if(inet_pton(AF_INET, ip, addr) != 1) return -1;
+    bits = 32;
+    n = 0;
+  }
+  if(!mkpath(&path, domain)) return -1;
+  if((fd = open(path.s, O_RDONLY|O_NOFOLLOW)) < 0) return -1;
+  if(!shm_safefile(fd) || fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof *h) {
+    close(fd);
+    return -1;
+  }
+  m = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if(m == MAP_FAILED) return -1;
+
+  h = m;
+  if(memcmp(h->magic, SPFCMAGIC, 8)
+     || sizeof *h + (size_t)h->nnodes*sizeof *nodes > (size_t)st.st_size
+     || (!(h->flags & SPFC_NOCOMP) && h->nnodes < 2)) {
+    r = -1;
+    goto done;
+  }
+  if(h->expires < (uint32_t)time(0)) {
+    r = -1;
+    goto done;
+  }
+  if(h->flags & SPFC_NOCOMP) {
+    r = 0;
+    goto done;
+  }
+
+  nodes = (const struct spfcnode *)((const char *)m + sizeof *h);
+  *qual = h->dflt;
+  for(i = 0; ; i++) {
+    if(nodes[n].order && (!best || nodes[n].order < best)) {
+      best = nodes[n].order;
+      *qual = nodes[n].qual;
+    }
+    if(i == bits) break;
+    n = nodes[n].kid[(addr[i/8] >> (7 - i%8)) & 1];
+    if(n == 0 || n >= h->nnodes) break;
+  }
+  r = 1;
+ done:
+  munmap(m, st.st_size);
+  return r;
+}
+
+/* the compiler */
+
+struct comp {
+  struct spfcnode *nodes;
+  unsigned nnodes;
+  unsigned size;
+  uint32_t order;
+  unsigned lookups;
+  uint32_t ttl;
+  int dflt;
+  int nocomp;
+};
+
+static int insert(struct comp *c, const unsigned char *addr, unsigned bits, int v6, int qual)
+{
+  unsigned n = v6 ? 1 : 0;
+  unsigned i;
+
+  for(i = 0; i < bits; i++) {
+    int b = (addr[i/8] >> (7 - i%8)) & 1;
+
+    if(!c->nodes[n].kid[b]) {
+      if(c->nnodes == c->size) {
+	struct spfcnode *nn = realloc(c->nodes, 2 * c->size * sizeof *nn);
+
+	if(!nn) return 0;
+	c->nodes = nn;
+	c->size *= 2;
+      }
+      memset(&c->nodes[c->nnodes], 0, sizeof *c->nodes);
+      c->nodes[n].kid[b] = c->nnodes++;
+    }
+    n = c->nodes[n].kid[b];
+  }
+  if(!c->nodes[n].order) {	/* an earlier one already wins */
+    c->nodes[n].order = c->order;
+    c->nodes[n].qual = qual;
+  }
+  return 1;
+}
+
+/* answers of one type, 1 OK, 0 none, -1 trouble */
+static int query(const char *name, int type, unsigned char *ans, unsigned size, ns_msg *msg)
+{
+  int len;
+
+  len = res_query(name, C_IN, type, ans, size);
+  if(len < 0)
+    return (h_errno == HOST_NOT_FOUND || h_errno == NO_DATA) ? 0 : -1;
+  if(ns_initparse(ans, len, msg) < 0) return -1;
+  return 1;
+}
+
+static void foldttl(struct comp *c, ns_rr *rr)
+{
+  if(ns_rr_ttl(*rr) < c->ttl) c->ttl = ns_rr_ttl(*rr);
+}
+
+/* a: or one mx host, both families */
+static int addhost(struct comp *c, const char *host, unsigned cidr4, unsigned cidr6, int qual)
+{
+  unsigned char ans[4096];
+  ns_msg msg;
+  ns_rr rr;
+  int t, r, i;
+
+  for(t = 0; t < 2; t++) {
+    int type = t ? T_AAAA : T_A;
+
+    if((r = query(host, type, ans, sizeof ans, &msg)) <= 0) {
+      if(r < 0) return -1;
+      continue;
+    }
+    for(i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+      if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) return -1;
+      if((int)ns_rr_type(rr) != type) continue;
+      if(ns_rr_rdlen(rr) != (t ? 16 : 4)) continue;
+      foldttl(c, &rr);
+      if(!insert(c, ns_rr_rdata(rr), t ? cidr6 : cidr4, t, qual)) return -1;
+    }
+  }
+  return 1;
+}
+
+static int addmx(struct comp *c, const char *domain, unsigned cidr4, unsigned cidr6, int qual)
+{
+  unsigned char ans[4096];
+  char host[NS_MAXDNAME];
+  ns_msg msg;
+  ns_rr rr;
+  int r, i, nmx = 0;
+
+  if((r = query(domain, T_MX, ans, sizeof ans, &msg)) <= 0) return r;
+  for(i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) return -1;
+    if(ns_rr_type(rr) != T_MX || ns_rr_rdlen(rr) < 3) continue;
+    foldttl(c, &rr);
+    if(++nmx > MAXLOOKUPS) {	/* permerror, let libspf2 say so */
+      c->nocomp = 1;
+      return 0;
+    }
+    if(ns_name_uncompress(ns_msg_base(msg), ns_msg_end(msg), ns_rr_rdata(rr) + 2,
+			  host, sizeof host) < 0)
+      return -1;
+    if(addhost(c, host, cidr4, cidr6, qual) < 0) return -1;
+  }
+  return 1;
+}
+
+/* the v=spf1 record, 1 found, 0 none, -1 trouble */
+static int spfrec(struct comp *c, const char *domain, str *rec)
+{
+  unsigned char ans[4096];
+  ns_msg msg;
+  ns_rr rr;
+  int r, i, found = 0;
+
+  if((r = query(domain, T_TXT, ans, sizeof ans, &msg)) <= 0) return r;
+  for(i = 0; i < ns_msg_count(msg, ns_s_an); i++) {
+    const unsigned char *p, *e;
+    static str txt;
+
+    if(ns_parserr(&msg, ns_s_an, i, &rr) < 0) return -1;
+    if(ns_rr_type(rr) != T_TXT) continue;
+    str_truncate(&txt, 0);
+    for(p = ns_rr_rdata(rr), e = p + ns_rr_rdlen(rr); p < e; p += 1 + *p) {
+      if(p + 1 + *p > e) break;
+      if(!str_catb(&txt, (const char *)p+1, *p)) return -1;
+    }
+    if(!str_case_starts(&txt, "v=spf1")
+       || (txt.len > 6 && txt.s[6] != ' ')) continue;
+    if(found++) {		/* two records is a permerror */
+      c->nocomp = 1;
+      return 0;
+    }
+    foldttl(c, &rr);
+    if(!str_copy(rec, &txt)) return -1;
+  }
+  return found ? 1 : 0;
+}
+
+/* "/n" suffix of ip4: and ip6: */
+static int prefix(char *arg, unsigned max, unsigned *len)
+{
+  char *s, *end;
+
+  *len = max;
+  if((s = strchr(arg, '/')) == 0) return 1;
+  *s = 0;
+  *len = strtoul(s+1, &end, 10);
+  return end != s+1 && !*end && *len <= max;
+}
+
+/* "/n" and "//n" suffixes of a: and mx: */
+static int cidrs(char *arg, unsigned *cidr4, unsigned *cidr6)
+{
+  char *s, *end;
+
+  *cidr4 = 32;
+  *cidr6 = 128;
+  if((s = strstr(arg, "//")) != 0) {
+    *s = 0;
+    *cidr6 = strtoul(s+2, &end, 10);
+    if(end == s+2 || *end || *cidr6 > 128) return 0;
+  }
+  if((s = strchr(arg, '/')) != 0) {
+    *s = 0;
+    *cidr4 = strtoul(s+1, &end, 10);
+    if(end == s+1 || *end || *cidr4 > 32) return 0;
+  }
+  return 1;
+}
+
+/*
+ * add domain's record to the trie
+ * at the top level qualifiers stand and all sets the default; inside
+ * an include every match gets the include's qualifier
+ * 1 OK, 0 can't compile, -1 trouble
+ */
+static int flatten(struct comp *c, const char *domain, int inner, int outer, int depth)
+{
+  str rec;
+  str redirect;
+  char *term, *next;
+  int r = 1;
+
+  if(depth > MAXDEPTH) return 0;
+  str_init(&rec);
+  str_init(&redirect);
+  if((r = spfrec(c, domain, &rec)) <= 0)
+    goto done;			/* none: libspf2 works out none or permerror */
+
+  for(term = rec.s + 6; term; term = next) {
+    int qual = '+';
+    char *arg;
+    unsigned cidr4, cidr6;
+    unsigned char addr[16];
+
+    while(*term == ' ') term++;
+    if(!*term) break;
+    if((next = strchr(term, ' ')) != 0) *next++ = 0;
+
+    if(strchr(term, '%')) goto nocomp;	/* macros */
+    if(!strncasecmp(term, "redirect=", 9)) {
+      if(!str_copys(&redirect, term + 9)) goto trouble;
+      continue;
+    }
+    if(strchr(term, '=')) continue;	/* exp= and unknown modifiers */
+
+    if(strchr("+-~?", *term)) qual = *term++;
+
+    if(!strcasecmp(term, "all")) {
+      if(!inner) c->dflt = qual;
+      else if(qual == '+') {	/* +all inside an include matches everyone */
+	c->order++;
+	if(!insert(c, addr, 0, 0, outer) || !insert(c, addr, 0, 1, outer))
+	  goto trouble;
+      }
+      str_truncate(&redirect, 0);	/* all beats redirect */
+      break;
+    }
+    if(inner && qual != '+') goto nocomp;
+    c->order++;
+    if(inner) qual = outer;
+
+    if(!strncasecmp(term, "ip4:", 4)) {
+      arg = term + 4;
+      if(!prefix(arg, 32, &cidr4) || inet_pton(AF_INET, arg, addr) != 1)
+	goto nocomp;
+      if(!insert(c, addr, cidr4, 0, qual)) goto trouble;
+    }
+    else if(!strncasecmp(term, "ip6:", 4)) {
+      arg = term + 4;
+      if(!prefix(arg, 128, &cidr6) || inet_pton(AF_INET6, arg, addr) != 1)
+	goto nocomp;
+      if(!insert(c, addr, cidr6, 1, qual)) goto trouble;
+    }
+    else if(!strncasecmp(term, "a", 1) && (!term[1] || strchr(":/", term[1]))) {
+      arg = term + 1;
+      if(!cidrs(arg, &cidr4, &cidr6)) goto nocomp;
+      if(++c->lookups > MAXLOOKUPS) goto nocomp;
+      if(addhost(c, *arg == ':' ? arg+1 : domain, cidr4, cidr6, qual) < 0) goto trouble;
+    }
+    else if(!strncasecmp(term, "mx", 2) && (!term[2] || strchr(":/", term[2]))) {
+      arg = term + 2;
+      if(!cidrs(arg, &cidr4, &cidr6)) goto nocomp;
+      if(++c->lookups > MAXLOOKUPS) goto nocomp;
+      if(addmx(c, *arg == ':' ? arg+1 : domain, cidr4, cidr6, qual) < 0) goto trouble;
+      if(c->nocomp) goto nocomp;
+    }
+    else if(!strncasecmp(term, "include:", 8)) {
+      if(++c->lookups > MAXLOOKUPS) goto nocomp;
+      if((r = flatten(c, term + 8, 1, qual, depth + 1)) <= 0) goto done;
+    }
+    else
+      goto nocomp;		/* exists:, ptr, or junk */
+  }
+
+  if(redirect.len) {
+    if(++c->lookups > MAXLOOKUPS) goto nocomp;
+    r = flatten(c, redirect.s, inner, outer, depth + 1);
+    goto done;
+  }
+  r = 1;
+  goto done;
+
+ nocomp:
+  r = 0;
+  goto done;
+ trouble:
+  r = -1;
+ done:
+  if(c->nocomp && r > 0) r = 0;
+  str_free(&rec);
+  str_free(&redirect);
+  return r;
+}
+
+int spfc_compile(const char *domain)
+{
+  static str path, tmp;
+  struct spfchdr h;
+  struct comp c;
+  const char *e;
+  uint32_t maxttl;
+  int fd, r, ok;
+
+  if(!mkpath(&path, domain) || !str_copy2s(&tmp, path.s, ".tmp.")
+     || !str_catu(&tmp, getpid())) return -1;
+  maxttl = (e = getenv("SPFCOMPTTL")) ? strtoul(e, 0, 10) : 3600;
+  if(maxttl < 60) maxttl = 60;
+
+  memset(&c, 0, sizeof c);
+  c.size = 1024;
+  if((c.nodes = calloc(c.size, sizeof *c.nodes)) == 0) return -1;
+  c.nnodes = 2;
+  c.ttl = maxttl;
+  c.dflt = '?';			/* no match and no all is neutral */
+
+  if((r = flatten(&c, domain, 0, '+', 0)) < 0) {
+    free(c.nodes);
+    return -1;
+  }
+  if(c.ttl < 60) c.ttl = 60;
+
+  memset(&h, 0, sizeof h);
+  memcpy(h.magic, SPFCMAGIC, 8);
+  h.expires = time(0) + (r ? c.ttl : maxttl);
+  h.dflt = c.dflt;
+  h.flags = r ? 0 : SPFC_NOCOMP;
+  h.nnodes = r ? c.nnodes : 0;
+
+  /* write and rename so lookups see the old one or the new one */
+  unlink(tmp.s);		/* left by a dead process with our pid */
+  if((fd = open(tmp.s, O_WRONLY|O_CREAT|O_EXCL|O_NOFOLLOW, 0644)) < 0) {
+    free(c.nodes);
+    return -1;
+  }
+  ok = write(fd, &h, sizeof h) == sizeof h
+    && (!h.nnodes
+	|| write(fd, c.nodes, h.nnodes * sizeof *c.nodes) == (ssize_t)(h.nnodes * sizeof *c.nodes));
+  if(close(fd) != 0) ok = 0;
+  free(c.nodes);
+  if(!ok || rename(tmp.s, path.s) != 0) {
+    unlink(tmp.s);
+    return -1;
+  }
+  return r;
+}
@@ -0,0 +1,389 @@
+/*
+ * spoolfeed, drains a backend-spool spool into qmail-queue
+ *
+ * usage: spoolfeed spooldir
+ * QMAILHOME and QMAILQUEUE as for backend-qmailsump
+ * SPOOLPOLL: milliseconds to wait for new mail, default 100
+ * SPOOLRETRY: seconds to wait after a temporary failure, default 10
+ *
+ * Records are fed in order once backend-spool's "state" says they're
+ * durable, skipping those it withdrew when their sync failed, and the
+ * position reached is kept in the file "feed" in the spool.  The
+ * position isn't synced, so a crash can feed a message twice but never
+ * loses one.  After a crash the last log may wait for the next message's
+ * sync to mark it durable again.  A finished log is removed once mail
+ * is going into the next one.  Messages qmail-queue rejects
+ * permanently have already been accepted, so their records are copied
+ * to the file "failed" for someone to look at.
+ *
+ * backend-spool appends and moves to the next log under the spool's
+ * "lock", so a log is only removed under that lock too, after a last
+ * look for records that went in after it was drained.  A record a
+ * crash left half written is skipped then, once nobody can still be
+ * writing it, and the records after it are fed before the log goes.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <misc/misc.h>
+#include <msg/msg.h>
+#include "conf_qmail.c"
+
+const char program[] = "spoolfeed";
+const int msg_show_pid = 0;
+
+extern char **environ;
+
+#define MAGIC "MFSPOOL1 "
+#define WITHDRAWN 'X'		/* in place of the 1, see backend-spool */
+#define TRAILER "\nEND\n"
+
+/* same as backend-spool */
+struct spoolstate {
+  uint32_t seg;
+  uint32_t durseg;
+  uint64_t durable;
+};
+
+struct feedpos {
+  uint32_t seg;
+  uint32_t pad;
+  uint64_t off;
+};
+
+static const char* qqargs[2] = { 0, 0 };
+static int spooldir;
+static int posfd;
+static int lockfd;		/* backend-spool's append lock */
+static int statefd = -1;	/* and its sync lock */
+static const struct spoolstate *state;
+static struct feedpos pos;
+static char buf[65536];
+
+static int open_log(uint32_t seg)
+{
+  char name[32];
+
+  strcpy(name, "log.");
+  strcpy(name+4, utoa(seg));
+  return openat(spooldir, name, O_RDONLY);
+}
+
+static int log_exists(uint32_t seg)
+{
+  char name[32];
+  struct stat st;
+
+  strcpy(name, "log.");
+  strcpy(name+4, utoa(seg));
+  return fstatat(spooldir, name, &st, 0) == 0;
+}
+
+/* backend-spool's state, once it has made it */
+static int map_state(void)
+{
+  struct stat st;
+  void *m;
+
+  if(state) return 1;
+  if(statefd < 0 && (statefd = openat(spooldir, "state", O_RDONLY)) < 0) {
+    if(errno != ENOENT) die1sys(111, "can't open spool state");
+    return 0;
+  }
+  if(fstat(statefd, &st) != 0) die1sys(111, "can't stat spool state");
+  if((size_t)st.st_size < sizeof *state) return 0;
+  m = mmap(0, sizeof *state, PROT_READ, MAP_SHARED, statefd, 0);
+  if(m == MAP_FAILED) die1sys(111, "can't map spool state");
+  state = m;
+  return 1;
+}
+
+/* how much of the current log, size long, is known to be durable */
+static uint64_t durable_end(uint64_t size)
+{
+  uint64_t end = 0;
+
+  if(!map_state()) return 0;
+  /* backend-spool changes it under this */
+  if(flock(statefd, LOCK_SH) != 0) die1sys(111, "can't lock spool state");
+  if(pos.seg < state->seg) end = size;	/* synced before it moved on */
+  else if(pos.seg == state->durseg) end = state->durable;
+  flock(statefd, LOCK_UN);
+  return end < size ? end : size;
+}
+
+static void save_pos(void)
+{
+  if(pwrite(posfd, &pos, sizeof pos, 0) != sizeof pos)
+    warn1sys("can't save feed position");
+}
+
+static void next_log(void)
+{
+  char name[32];
+
+  strcpy(name, "log.");
+  strcpy(name+4, utoa(pos.seg));
+  if(unlinkat(spooldir, name, 0) != 0) warn2sys("can't remove ", name);
+  pos.seg++;
+  pos.off = 0;
+  save_pos();
+}
+
+static int readat(int fd, char *s, unsigned long len, uint64_t off)
+{
+  ssize_t rd;
+
+  while(len > 0) {
+    if((rd = pread(fd, s, len, off)) <= 0) return 0;
+    s += rd;
+    len -= rd;
+    off += rd;
+  }
+  return 1;
+}
+
+/* copy len bytes at off in the log to out */
+static int copyout(int out, int fd, unsigned long len, uint64_t off)
+{
+  unsigned long n;
+  ssize_t wr;
+  char *s;
+
+  while(len > 0) {
+    n = len < sizeof buf ? len : sizeof buf;
+    if(!readat(fd, buf, n, off)) return 0;
+    for(s = buf; s < buf + n; s += wr)
+      if((wr = write(out, s, buf + n - s)) <= 0) return 0;
+    len -= n;
+    off += n;
+  }
+  return 1;
+}
+
+/* offset of the next record header after off, or size */
+static uint64_t resync(int fd, uint64_t off, uint64_t size)
+{
+  const unsigned mlen = sizeof MAGIC - 1;
+  unsigned long n;
+  char *p;
+
+  for(off++; off + mlen <= size; off += n - mlen + 1) {
+    n = size - off < sizeof buf ? size - off : sizeof buf;
+    if(!readat(fd, buf, n, off)) break;
+    if((p = memmem(buf, n, MAGIC, mlen)) != 0) return off + (p - buf);
+    if(n <= mlen) break;
+  }
+  return size;
+}
+
+/* run qmail-queue on one record, returns its exit status or -1 */
+static int feed(int fd, uint64_t envoff, unsigned long envlen,
+		uint64_t msgoff, unsigned long msglen)
+{
+  posix_spawn_file_actions_t fa;
+  int mpipe[2], epipe[2];
+  pid_t pid;
+  int status;
+  int ok;
+
+  if(pipe(mpipe) != 0) return -1;
+  if(pipe(epipe) != 0) {
+    close(mpipe[0]);
+    close(mpipe[1]);
+    return -1;
+  }
+  posix_spawn_file_actions_init(&fa);
+  posix_spawn_file_actions_adddup2(&fa, mpipe[0], 0);
+  posix_spawn_file_actions_adddup2(&fa, epipe[0], 1);
+  posix_spawn_file_actions_addclose(&fa, mpipe[1]);
+  posix_spawn_file_actions_addclose(&fa, epipe[1]);
+  ok = posix_spawnp(&pid, qqargs[0], &fa, 0, (char**)qqargs, environ) == 0;
+  posix_spawn_file_actions_destroy(&fa);
+  close(mpipe[0]);
+  close(epipe[0]);
+  if(!ok) {
+    close(mpipe[1]);
+    close(epipe[1]);
+    warn2sys("can't start ", qqargs[0]);
+    return -1;
+  }
+
+  /* qmail-queue reads all the message before the envelope */
+  ok = copyout(mpipe[1], fd, msglen, msgoff);
+  close(mpipe[1]);
+  ok = ok && copyout(epipe[1], fd, envlen, envoff);
+  close(epipe[1]);
+
+  while(waitpid(pid, &status, 0) == -1)
+    if(errno != EINTR) return -1;
+  if(!WIFEXITED(status)) return -1;
+  return ok ? WEXITSTATUS(status) : -1;
+}
+
+static void keep_failed(int fd, uint64_t off, unsigned long len)
+{
+  int out;
+
+  if((out = openat(spooldir, "failed", O_WRONLY|O_APPEND|O_CREAT, 0600)) < 0
+     || !copyout(out, fd, len, off))
+    warn1sys("can't save failed message");
+  if(out >= 0) close(out);
+}
+
+/* done with a log seen at size, if nothing's been added since: on to
+   the next, or if it stopped at a torn record, on past that */
+static void finish_log(int fd, uint64_t size, int torn)
+{
+  struct stat st;
+
+  /* no session can be partway through adding to it while we hold this,
+     and once there's a next log none will add to it again */
+  if(flock(lockfd, LOCK_EX) != 0) die1sys(111, "can't lock spool");
+  if(fstat(fd, &st) != 0) die1sys(111, "can't stat spool log");
+  if((uint64_t)st.st_size <= size) {
+    if(!torn)
+      next_log();
+    else {
+      /* left by a crash, there may be good records after it */
+      warn1("torn record in spool log, skipping");
+      pos.off = resync(fd, pos.off, size);
+      save_pos();
+    }
+  }
+  flock(lockfd, LOCK_UN);
+}
+
+/* feed what's in the current log, returns 0 when there's nothing to do */
+static int feed_log(void)
+{
+  struct stat st;
+  uint64_t size;
+  char hdr[64];
+  char *end;
+  unsigned long envlen, msglen, hlen, reclen;
+  int status;
+  int withdrawn;
+  int torn = 0;			/* stopped at a record that isn't all there */
+  int fd;
+
+  if((fd = open_log(pos.seg)) < 0) {
+    if(errno != ENOENT) die1sys(111, "can't open spool log");
+    if(!log_exists(pos.seg + 1)) return 0;
+    pos.seg++;			/* a gap, shouldn't happen */
+    pos.off = 0;
+    save_pos();
+    return 1;
+  }
+
+  for(;;) {
+    if(fstat(fd, &st) != 0) die1sys(111, "can't stat spool log");
+    /* only what backend-spool has synced, a record that got a 451
+       mustn't be fed */
+    size = durable_end(st.st_size);
+    if(pos.off >= size) break;
+
+    memset(hdr, 0, sizeof hdr);
+    hlen = size - pos.off < sizeof hdr - 1 ? size - pos.off : sizeof hdr - 1;
+    if(!readat(fd, hdr, hlen, pos.off)) die1sys(111, "can't read spool log");
+    if((withdrawn = hlen > 7 && hdr[7] == WITHDRAWN)) hdr[7] = MAGIC[7];
+    if(memcmp(hdr, MAGIC, hlen < sizeof MAGIC - 1 ? hlen : sizeof MAGIC - 1)) {
+      warn1("bad record in spool log, skipping");
+      pos.off = resync(fd, pos.off, size);
+      save_pos();
+      continue;
+    }
+    if((end = memchr(hdr, '\n', hlen)) == 0) { /* still being written */
+      torn = 1;
+      break;
+    }
+    envlen = strtoul(hdr + sizeof MAGIC - 1, &end, 10);
+    msglen = strtoul(end, &end, 10);
+    hlen = end + 1 - hdr;
+    reclen = hlen + envlen + msglen + sizeof TRAILER - 1;
+    if(pos.off + reclen > size) {
+      torn = 1;
+      break;
+    }
+    if(*end != '\n'
+       || !readat(fd, hdr, sizeof TRAILER - 1, pos.off + reclen - (sizeof TRAILER - 1))
+       || memcmp(hdr, TRAILER, sizeof TRAILER - 1)) {
+      warn1("bad record in spool log, skipping");
+      pos.off = resync(fd, pos.off, size);
+      save_pos();
+      continue;
+    }
+    if(withdrawn) {		/* its sync failed, the client retries */
+      warn1("withdrawn record in spool log, skipping");
+      pos.off += reclen;
+      save_pos();
+      continue;
+    }
+
+    status = feed(fd, pos.off + hlen, envlen, pos.off + hlen + envlen, msglen);
+    if(status == -1 || (status != 0 && (status < 11 || status > 40))) {
+      warn2("qmail-queue failed temporarily, exit ", utoa(status));
+      close(fd);
+      sleep(atoi(getenv("SPOOLRETRY") ? getenv("SPOOLRETRY") : "10"));
+      return 1;
+    }
+    if(status != 0) {
+      warn2("qmail-queue rejected message, exit ", utoa(status));
+      keep_failed(fd, pos.off, reclen);
+    }
+    pos.off += reclen;
+    save_pos();
+  }
+
+  /* a torn record or the end, either way done with it once there's a
+     next, unless a last record went in before the next was started */
+  if(log_exists(pos.seg + 1)) {
+    finish_log(fd, size, torn);
+    close(fd);
+    return 1;
+  }
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char **argv)
+{
+  const char *qh;
+  const char *s;
+  int pollms = 100;
+
+  if(argc != 2) die1(111, "usage: spoolfeed spooldir");
+  if((s = getenv("SPOOLPOLL")) != 0) pollms = atoi(s);
+  if((qqargs[0] = getenv("QMAILQUEUE")) == 0) qqargs[0] = "bin/qmail-queue";
+
+  if((spooldir = open(argv[1], O_RDONLY|O_DIRECTORY)) < 0)
+    die2sys(111, "can't open ", argv[1]);
+  if((posfd = openat(spooldir, "feed", O_RDWR|O_CREAT, 0600)) < 0)
+    die1sys(111, "can't open feed position");
+  if((lockfd = openat(spooldir, "lock", O_RDWR|O_CREAT, 0600)) < 0)
+    die1sys(111, "can't open spool lock");
+  if(pread(posfd, &pos, sizeof pos, 0) != sizeof pos)
+    memset(&pos, 0, sizeof pos);
+
+  if((qh = getenv("QMAILHOME")) == 0) qh = conf_qmail;
+  if(chdir(qh) == -1) die2sys(111, "can't chdir to ", qh);
+  signal(SIGPIPE, SIG_IGN);
+
+  for(;;)
+    if(!feed_log()) poll(0, 0, pollms);
+  return 0;
+}